@@ -0,0 +1,142 @@
+#include "shell.h"
+
+/* With ADMIT_CPU, ADMIT_MEM or ADMIT_LOAD set, background jobs are started
+ * only while the system isn't under pressure. ADMIT_CPU and ADMIT_MEM limit
+ * the share of time (in percent) in which some tasks stalled waiting for CPU
+ * or memory over the last 10 seconds, as reported by Linux pressure stall
+ * information (PSI). ADMIT_LOAD limits 1-minute load average. A job started
+ * above any of the limits gets queued: its processes stop themselves right
+ * before exec, so the job with its pipes and redirections is ready to go.
+ * A timer continues the oldest queued job once pressure falls, one job per
+ * tick, so that released jobs don't cause the next spike together. */
+
+#define ADMIT_TICK_MSEC 1000
+
+enum { CPU, MEM, LOAD, NLIMITS };
+
+static const char *var[NLIMITS] = {"ADMIT_CPU", "ADMIT_MEM", "ADMIT_LOAD"};
+static const char *path[NLIMITS] = {"/proc/pressure/cpu",
+                                    "/proc/pressure/memory", "/proc/loadavg"};
+static const char *key[NLIMITS] = {"avg10=", "avg10=", ""};
+
+static long limit[NLIMITS]; /* in hundredths, 0 if there's no limit */
+
+/* Parses decimal number like 12.34 as 1234. Returns -1 if it's not valid. */
+static long hundredths(const char *s) {
+  long val = 0;
+  int digits = 0; /* digits taken after decimal point */
+
+  if (*s < '0' || *s > '9')
+    return -1;
+  for (; *s >= '0' && *s <= '9'; s++)
+    val = val * 10 + *s - '0';
+  if (*s == '.')
+    s++;
+  for (; digits < 2 && *s >= '0' && *s <= '9'; s++) {
+    val = val * 10 + *s - '0';
+    digits++;
+  }
+  for (; digits < 2; digits++)
+    val *= 10;
+  return val;
+}
+
+/* Reads number that follows `key` in the file at `path`, as hundredths.
+ * Only async-signal-safe functions are used, it's called by the timer. */
+static long readval(const char *path, const char *key) {
+  char buf[256];
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+
+  char *s = strstr(buf, key);
+  return s ? hundredths(s + strlen(key)) : -1;
+}
+
+/* Checks if the system is below all limits. Limits that can't be checked,
+ * e.g. on kernels without PSI, never hold jobs back. */
+bool pressure_ok(void) {
+  for (int i = 0; i < NLIMITS; i++) {
+    if (limit[i] <= 0)
+      continue;
+    long val = readval(path[i], key[i]);
+    if (val > limit[i])
+      return false;
+  }
+  return true;
+}
+
+/* Called when a background job is about to start, with SIGCHLD blocked.
+ * Limits are taken from the variables anew, and apply to queued jobs too.
+ * Jobs are admitted in order, so a new job waits behind the queued ones. */
+bool admitjob(void) {
+  bool on = false;
+
+  for (int i = 0; i < NLIMITS; i++) {
+    const char *s = getenv(var[i]);
+    limit[i] = s && *s ? hundredths(s) : 0;
+    if (limit[i] < 0) {
+      msg("warning: invalid %s value '%s'\n", var[i], s);
+      limit[i] = 0;
+    }
+    on |= limit[i] > 0;
+  }
+
+  return !on || (!queuedjobs() && pressure_ok());
+}
+
+#ifdef LINUX
+static timer_t timer;
+static bool timer_made = false;
+
+static void admit_handler(int sig) {
+  int old_errno = errno;
+  (void)sig;
+  if (!releasejob())
+    admittimer(false);
+  errno = old_errno;
+}
+#endif
+
+/* Start ticking while there are queued jobs, or stop it. */
+void admittimer(bool on) {
+#ifdef LINUX
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+
+  if (!timer_made) {
+    if (!on)
+      return;
+
+    /* Timer changes the job table, just like SIGCHLD handler. */
+    struct sigaction act = {
+      .sa_handler = admit_handler,
+      .sa_flags = SA_RESTART,
+      .sa_mask = sigchld_mask,
+    };
+    Sigaction(SIGADMIT, &act, NULL);
+
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGADMIT;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &timer) < 0)
+      unix_error("timer_create error");
+    timer_made = true;
+  }
+
+  if (on) {
+    its.it_interval.tv_sec = ADMIT_TICK_MSEC / 1000;
+    its.it_interval.tv_nsec = ADMIT_TICK_MSEC % 1000 * 1000000;
+    its.it_value = its.it_interval;
+  }
+  (void)timer_settime(timer, 0, &its, NULL);
+#else
+  (void)on;
+#endif
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Times running a 10k-line script from the compiled script cache, against
+# compiling it on every run with -N. Lines are builtins that don't fork, so
+# the time goes to reading, parsing and running commands. The first run
+# with the cache, which compiles the script and writes the cache file, is
+# timed on its own.
+
+SH=${SH:-./shell}
+LINES=${LINES:-10000}
+ROUNDS=${ROUNDS:-10}
+# leak checking of the sanitized build would take most of the time
+export ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0}
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+export XDG_CACHE_HOME=$T/cache
+
+# time ROUNDS COMMAND - print seconds that running COMMAND ROUNDS times takes
+time_rounds() {
+  rounds=$1
+  shift
+  start=$(date +%s.%N)
+  i=0
+  while [ $i -lt $rounds ]; do
+    "$@" > /dev/null 2>&1
+    i=$((i + 1))
+  done
+  end=$(date +%s.%N)
+  awk -v s="$start" -v e="$end" 'BEGIN { print e - s }'
+}
+
+i=0
+while [ $i -lt $LINES ]; do
+  echo "true line $i && : \$HOME || false > /dev/null"
+  i=$((i + 1))
+done > "$T/script"
+
+report() {
+  awk -v n=$2 -v t="$3" -v what="$1" 'BEGIN {
+    printf "%-12s %.2fms per run\n", what ":", t / n * 1e3
+  }'
+}
+
+report "first run" 1 $(time_rounds 1 $SH "$T/script")
+report "cached" $ROUNDS $(time_rounds $ROUNDS $SH "$T/script")
+report "uncached" $ROUNDS $(time_rounds $ROUNDS $SH -N "$T/script")
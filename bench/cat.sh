@@ -0,0 +1,34 @@
+#!/bin/sh
+# Measures throughput of the builtin cat against /bin/cat, copying a file of
+# SIZE megabytes to another file, to /dev/null, into a pipe and out of one.
+# Each kind of descriptor pair takes a different path in the builtin: copy
+# between files, sendfile(2) or splice(2).
+
+SH=${SH:-./shell}
+SIZE=${SIZE:-1024}
+# leak checking of the sanitized build would take most of the time
+export ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0}
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+head -c ${SIZE}M /dev/urandom > "$T/in"
+
+# run NAME LINE - print throughput of the shell running LINE, in which CAT
+# stands for the cat being measured
+run() {
+  for cat in cat /bin/cat; do
+    echo "$2" | sed "s|CAT|$cat|g; s|IN|$T/in|; s|OUT|$T/out|" > "$T/script"
+    rm -f "$T/out"
+    start=$(date +%s.%N)
+    $SH -N "$T/script" < /dev/null
+    end=$(date +%s.%N)
+    awk -v s="$start" -v e="$end" -v mb=$SIZE -v name="$1" -v cat=$cat \
+      'BEGIN { printf "%-16s %-8s %.2f GB/s\n", name ":", cat,
+               mb / 1024 / (e - s) }'
+  done
+}
+
+run "file to file" "CAT IN > OUT"
+run "file to null" "CAT IN > /dev/null"
+run "file to pipe" "CAT IN | /bin/cat > /dev/null"
+run "pipe to file" "/bin/cat IN | CAT > OUT"
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Times 100k iterations of nested for loops, whose body runs the builtin
+# `true`, then calls a function doing the same. No iteration may fork, so
+# the time goes to running the parsed loop body again and again. The same
+# script is run by dash(1) for comparison, when it's installed.
+
+SH=${SH:-./shell}
+# leak checking of the sanitized build would take most of the time
+export ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0}
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+# loop BODY - write 10^5 iterations of BODY to $T/script
+loop() {
+  digits="0 1 2 3 4 5 6 7 8 9"
+  {
+    echo "f() { true \$1 ; }"
+    for v in a b c d e; do
+      echo "for $v in $digits ; do"
+    done
+    echo "$1"
+    for v in a b c d e; do
+      echo "done"
+    done
+  } > "$T/script"
+}
+
+# run SHELL - print seconds SHELL takes to run $T/script
+run() {
+  start=$(date +%s.%N)
+  $1 "$T/script" > /dev/null 2>&1
+  end=$(date +%s.%N)
+  awk -v s="$start" -v e="$end" 'BEGIN { print e - s }'
+}
+
+for body in "true \$a\$b\$c\$d\$e" "f \$a\$b\$c\$d\$e"; do
+  loop "$body"
+  for sh in "$SH -N" dash; do
+    command -v ${sh%% *} > /dev/null || continue
+    secs=$(run "$sh")
+    awk -v t="$secs" -v sh="${sh%% *}" -v body="${body%% *}" 'BEGIN {
+      printf "%-8s %-8s %.3fs, %.2fus per iteration\n", sh, body, t,
+             t / 1e5 * 1e6
+    }'
+  done
+done
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Times setting up pipelines of 10, 100 and 1000 stages. Each stage is the
+# builtin `true`, which exits at once, so the time goes to making pipes and
+# forking stages. Every pipeline is run ROUNDS times by a single shell, whose
+# startup is timed alone and taken away.
+
+SH=${SH:-./shell}
+ROUNDS=${ROUNDS:-5}
+# leak checking of the sanitized build would take most of the time
+export ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0}
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+# run FILE - print seconds the shell takes to run script FILE
+run() {
+  start=$(date +%s.%N)
+  $SH -N "$1" > /dev/null < /dev/null
+  end=$(date +%s.%N)
+  awk -v s="$start" -v e="$end" 'BEGIN { print e - s }'
+}
+
+: > "$T/empty"
+base=$(run "$T/empty")
+
+for n in 10 100 1000; do
+  line=true
+  i=1
+  while [ $i -lt $n ]; do
+    line="$line | true"
+    i=$((i + 1))
+  done
+  i=0
+  while [ $i -lt $ROUNDS ]; do
+    echo "$line"
+    i=$((i + 1))
+  done > "$T/script"
+
+  secs=$(run "$T/script")
+  echo "$n $ROUNDS $secs $base" | awk '{
+    t = $3 - $4
+    printf "%5d stages: %.3fs per pipeline, %.1fus per stage\n",
+           $1, t / $2, t / $2 / $1 * 1e6
+  }'
+done
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Measures throughput of a 3-stage pipeline moving SIZE bytes (10G unless
+# given, in head(1) units): a producer, a filter and a consumer, each doing
+# I/O in small chunks. Runs with default pipes, with pipes of PIPESIZE=1M and
+# with pipes grown by PIPESIZE=auto.
+
+SH=${SH:-./shell}
+SIZE=${SIZE:-10G}
+# leak checking of the sanitized build would take most of the time
+export ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0}
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+echo "head -c $SIZE /dev/zero | tr a b | wc -c > $T/bytes" > "$T/script"
+
+for size in "" 1M auto; do
+  start=$(date +%s.%N)
+  PIPESIZE=$size $SH -N "$T/script" < /dev/null
+  end=$(date +%s.%N)
+  awk -v s="$start" -v e="$end" -v size="${size:-default}" \
+      -v bytes=$(cat "$T/bytes") \
+    'BEGIN { printf "%-8s %.2fs, %.2f GB/s\n", size ":", e - s,
+             bytes / 2^30 / (e - s) }'
+done
@@ -0,0 +1,268 @@
+#include "csapp.h"
+#include "rio.h"
+
+/* Benchmark of rio readers. A file of short lines and a file of long lines
+ * are read in bulk and line by line, from the file itself and through
+ * a pipe, by each kind of reader: plain read(), fixed and adaptive buffers,
+ * mapping, io_uring ring and the ring that must fall back to read() because
+ * io_uring refuses its depth. Every run must see all bytes and lines of the
+ * file, so the benchmark doubles as a test of the readers. Last, NREADERS
+ * readers take turns on one file, and memory held by their buffers is
+ * reported before and after they go idle. */
+
+#define CHUNK 65536           /* user buffer of bulk reads */
+#define SHORTLINE 40          /* length of short lines */
+#define LONGLINE 100000       /* length of long lines, crossing refills */
+#define RINGDEPTH 4           /* reads queued ahead in io_uring */
+#define NOTRINGDEPTH (1 << 20) /* more entries than io_uring accepts */
+#define NREADERS 10000
+#define TURNBYTES 16384 /* data per reader when they take turns */
+
+typedef enum { PLAIN, FIXED, ADAPTIVE, MAP, RING, FALLBACK, NKINDS } kind_t;
+static const char *kindname[NKINDS] = {"read", "64K buffer", "adaptive",
+                                       "map", "ring", "ring fallback"};
+
+typedef enum { READNB, READLINEB, GETLINEB, FETCHLINEB, NMETHODS } method_t;
+static const char *methodname[NMETHODS] = {"readnb", "readlineb", "getlineb",
+                                           "fetchlineb"};
+
+typedef struct {
+  char path[32];
+  size_t bytes; /* file size */
+  size_t lines; /* number of lines */
+} data_t;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fills a new temporary file with `size` bytes of lines `linelen` long. */
+static void mkdata(data_t *d, size_t size, size_t linelen) {
+  char *buf = Malloc(CHUNK);
+  size_t n = 0, col = 0;
+
+  strcpy(d->path, "/tmp/riobench.XXXXXX");
+  int fd = mkstemp(d->path);
+  if (fd < 0)
+    unix_error("mkstemp error");
+
+  d->bytes = size;
+  d->lines = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (++col == linelen || i == size - 1) {
+      buf[n++] = '\n';
+      col = 0;
+      d->lines++;
+    } else {
+      buf[n++] = 'a' + col % 26;
+    }
+    if (n == CHUNK || i == size - 1) {
+      Rio_writen(fd, buf, n);
+      n = 0;
+    }
+  }
+  Close(fd);
+  free(buf);
+}
+
+/* Opens data file, or a pipe that a child process copies the file into. */
+static int opendata(data_t *d, bool pipe, pid_t *pidp) {
+  int fd = Open(d->path, O_RDONLY, 0);
+  int fds[2];
+
+  *pidp = -1;
+  if (!pipe)
+    return fd;
+
+  Pipe(fds);
+  fflush(stdout); /* child must not print results again on exit */
+  if ((*pidp = Fork()) == 0) {
+    char *buf = Malloc(CHUNK);
+    ssize_t n;
+    Close(fds[0]);
+    while ((n = Read(fd, buf, CHUNK)) > 0)
+      Rio_writen(fds[1], buf, n);
+    exit(0);
+  }
+  Close(fds[1]);
+  Close(fd);
+  return fds[0];
+}
+
+static void initb(rio_t *rp, int fd, kind_t kind) {
+  switch (kind) {
+  case PLAIN:
+    rio_readinitb(rp, fd);
+    break;
+  case FIXED:
+    rio_readinitb_size(rp, fd, CHUNK);
+    break;
+  case ADAPTIVE:
+    rio_readinitb_size(rp, fd, RIO_ADAPTIVE);
+    break;
+  case MAP:
+    rio_readinitb_map(rp, fd);
+    break;
+  case RING:
+    rio_readinitb_ring(rp, fd, RINGDEPTH);
+    break;
+  case FALLBACK:
+    rio_readinitb_ring(rp, fd, NOTRINGDEPTH);
+    if (rp->rio_ring)
+      app_error("io_uring took %d entries, fallback not exercised",
+                NOTRINGDEPTH);
+    break;
+  default:
+    break;
+  }
+}
+
+/* Reads the whole stream with given method, counts bytes and lines. */
+static void readall(rio_t *rp, method_t method, size_t *bytesp,
+                    size_t *linesp) {
+  static char buf[CHUNK];
+  char *line = NULL;
+  size_t size = 0, bytes = 0, lines = 0;
+  ssize_t n;
+
+  for (;;) {
+    if (method == READNB) {
+      n = Rio_readnb(rp, buf, CHUNK);
+      for (char *p = buf; (p = memchr(p, '\n', buf + n - p)); p++)
+        lines++;
+    } else if (method == READLINEB) {
+      n = Rio_readlineb(rp, buf, CHUNK);
+      lines += n > 0 && buf[n - 1] == '\n';
+    } else if (method == GETLINEB) {
+      n = Rio_getlineb(rp, &line, &size);
+      lines += n > 0 && line[n - 1] == '\n';
+    } else {
+      char *piece;
+      n = Rio_fetchlineb(rp, &piece);
+      lines += n > 0 && piece[n - 1] == '\n';
+    }
+    if (n == 0)
+      break;
+    bytes += n;
+  }
+  if (method == GETLINEB)
+    free(line);
+  *bytesp = bytes;
+  *linesp = lines;
+}
+
+static void run(const char *name, data_t *d, bool pipe, kind_t kind,
+                method_t method) {
+  size_t bytes, lines;
+  pid_t pid;
+  rio_t rio;
+
+  int fd = opendata(d, pipe, &pid);
+  double start = now();
+  initb(&rio, fd, kind);
+  bool fellback = kind == RING && rio.rio_ring == NULL;
+  readall(&rio, method, &bytes, &lines);
+  rio_closeb(&rio);
+  double secs = now() - start;
+  Close(fd);
+  if (pid > 0)
+    Waitpid(pid, NULL, 0);
+
+  if (bytes != d->bytes || lines != d->lines)
+    app_error("%s %s %s %s: read %zu bytes in %zu lines, expected %zu in %zu",
+              name, pipe ? "pipe" : "file", kindname[kind],
+              methodname[method], bytes, lines, d->bytes, d->lines);
+  printf("%-12s %-5s %-14s %-11s %8.1f MB/s%s\n", name,
+         pipe ? "pipe" : "file", kindname[kind], methodname[method],
+         bytes / secs / 1e6, fellback ? " (no io_uring, read() used)" : "");
+}
+
+/* Sums buffers held by readers. */
+static size_t heldbufs(rio_t *rio, int n) {
+  size_t sum = 0;
+  for (int i = 0; i < n; i++)
+    if (rio[i].rio_buf)
+      sum += rio[i].rio_bufsize;
+  return sum;
+}
+
+/* NREADERS adaptive readers share a descriptor and take turns reading
+ * a line each, until they all reach EOF. */
+static void turns(void) {
+  rio_t *rio = Calloc(NREADERS, sizeof(rio_t));
+  bool *eof = Calloc(NREADERS, sizeof(bool));
+  size_t bytes = 0, held = 0;
+  char buf[SHORTLINE + 1];
+  data_t d;
+  int left = NREADERS;
+
+  mkdata(&d, (size_t)NREADERS * TURNBYTES, SHORTLINE);
+  int fd = Open(d.path, O_RDONLY, 0);
+  for (int i = 0; i < NREADERS; i++)
+    rio_readinitb_size(&rio[i], fd, RIO_ADAPTIVE);
+
+  double start = now();
+  while (left > 0) {
+    for (int i = 0; i < NREADERS; i++) {
+      if (eof[i])
+        continue;
+      ssize_t n = Rio_readlineb(&rio[i], buf, sizeof(buf));
+      if (n == 0) {
+        eof[i] = true;
+        left--;
+      }
+      bytes += n;
+    }
+    held = max(held, heldbufs(rio, NREADERS));
+  }
+  double secs = now() - start;
+
+  size_t done = heldbufs(rio, NREADERS);
+  for (int i = 0; i < NREADERS; i++)
+    rio_idleb(&rio[i]);
+  size_t idle = heldbufs(rio, NREADERS);
+
+  if (bytes != d.bytes)
+    app_error("%d readers: read %zu bytes, expected %zu", NREADERS, bytes,
+              d.bytes);
+  printf("%d readers: %.1f MB/s, buffers %zu KB at most, %zu KB at EOF, "
+         "%zu KB idle\n", NREADERS, bytes / secs / 1e6, held >> 10,
+         done >> 10, idle >> 10);
+
+  for (int i = 0; i < NREADERS; i++)
+    rio_closeb(&rio[i]);
+  Close(fd);
+  Unlink(d.path);
+  free(eof);
+  free(rio);
+}
+
+int main(int argc, char *argv[]) {
+  size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+  data_t shortlines, longlines;
+
+  if (mb == 0)
+    app_error("usage: %s [MEGABYTES]", argv[0]);
+
+  mkdata(&shortlines, mb << 20, SHORTLINE);
+  mkdata(&longlines, mb << 20, LONGLINE);
+
+  for (int pipe = 0; pipe <= 1; pipe++)
+    for (kind_t kind = PLAIN; kind < NKINDS; kind++)
+      run("bulk", &shortlines, pipe, kind, READNB);
+
+  for (method_t method = READLINEB; method < NMETHODS; method++) {
+    for (kind_t kind = PLAIN; kind < NKINDS; kind++)
+      run("short lines", &shortlines, false, kind, method);
+    for (kind_t kind = PLAIN; kind < NKINDS; kind++)
+      run("long lines", &longlines, false, kind, method);
+  }
+
+  turns();
+
+  Unlink(shortlines.path);
+  Unlink(longlines.path);
+  return 0;
+}
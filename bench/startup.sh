@@ -0,0 +1,63 @@
+#!/bin/sh
+# Times how long an interactive shell takes to show its first prompt and to
+# run a one-shot `-c` command, and reports peak memory the shell uses to
+# start. Prompts are only shown on a terminal, so the shell runs under
+# script(1), whose own startup is timed alone and taken away. Build with
+# READLINE=1 to see what loading line editing at the first prompt costs.
+
+SH=${SH:-./shell}
+ROUNDS=${ROUNDS:-20}
+# leak checking of the sanitized build would take most of the time
+export ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0}
+
+# time ROUNDS COMMAND - print seconds that running COMMAND ROUNDS times takes
+time_rounds() {
+  rounds=$1
+  shift
+  start=$(date +%s.%N)
+  i=0
+  while [ $i -lt $rounds ]; do
+    "$@" > /dev/null 2>&1
+    i=$((i + 1))
+  done
+  end=$(date +%s.%N)
+  awk -v s="$start" -v e="$end" 'BEGIN { print e - s }'
+}
+
+# prompt CMD - run CMD on a terminal, which ends right away as script(1)
+# passes on the end of its empty input
+prompt() {
+  script -qc "$1" /dev/null < /dev/null
+}
+
+if command -v script > /dev/null; then
+  base=$(time_rounds $ROUNDS prompt cat)
+  secs=$(time_rounds $ROUNDS prompt "$SH")
+  awk -v n=$ROUNDS -v t="$secs" -v b="$base" 'BEGIN {
+    printf "first prompt: %.2fms\n", (t - b) / n * 1e3
+  }'
+else
+  echo "first prompt: script(1) not found"
+fi
+
+# Running a single command with -c, next to dash(1) doing the same, which
+# is about as fast to start as shells get.
+for sh in "$SH" dash; do
+  command -v $sh > /dev/null || continue
+  secs=$(time_rounds $ROUNDS $sh -c :)
+  awk -v n=$ROUNDS -v t="$secs" -v sh="$sh" 'BEGIN {
+    printf "%s -c: %.2fms\n", sh, t / n * 1e3
+  }'
+done
+
+# Peak RSS once the shell can run commands. Without time(1) the builtin cat,
+# which runs within the shell, reads the shell's own status.
+if [ -x /usr/bin/time ]; then
+  /usr/bin/time -v $SH -c : 2>&1 | awk -F': *' '/Maximum resident/ {
+    printf "peak RSS: %d kB\n", $2
+  }'
+else
+  $SH -c 'cat /proc/self/status' | awk '/^VmHWM:/ {
+    printf "peak RSS: %d kB\n", $2
+  }'
+fi
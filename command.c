@@ -1,4 +1,9 @@
+#ifdef LINUX
+#include <sys/sendfile.h>
+#endif
+
 #include "shell.h"
+#include "rio.h"
 
 typedef int (*func_t)(char **argv);
 
@@ -31,8 +36,11 @@ static int do_chdir(char **argv) {
 
 /*
  * Displays all stopped or running jobs.
+ * 'jobs -v' also reports flow through pipes of measured pipelines
  */
 static int do_jobs(char **argv) {
+  if (argv[0] && !strcmp(argv[0], "-v"))
+    statjobs();
   watchjobs(ALL);
   return 0;
 }
@@ -47,8 +55,12 @@ static int do_fg(char **argv) {
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, FG, &mask))
-    msg("fg: job not found: %s\n", argv[0]);
+  if (!resumejob(j, FG, &mask)) {
+    if (argv[0])
+      msg("fg: job not found: %s\n", argv[0]);
+    else
+      msg("fg: no current job\n");
+  }
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
@@ -63,8 +75,12 @@ static int do_bg(char **argv) {
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, BG, &mask))
-    msg("bg: job not found: %s\n", argv[0]);
+  if (!resumejob(j, BG, &mask)) {
+    if (argv[0])
+      msg("bg: job not found: %s\n", argv[0]);
+    else
+      msg("bg: no current job\n");
+  }
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
@@ -91,11 +107,470 @@ static int do_kill(char **argv) {
   return 0;
 }
 
+/*
+ * Do nothing, successfully or not. Used as loop conditions.
+ */
+static int do_true(char **argv) {
+  return 0;
+}
+
+static int do_false(char **argv) {
+  return 1;
+}
+
+#define CATCHUNK (1L << 30) /* max bytes moved by single in-kernel copy */
+#define CATBUFSZ (128 * 1024) /* buffer used when kernel can't copy */
+
+/* Ways of copying data from one descriptor to another, from the fastest. */
+enum { SPLICE, COPY_RANGE, SENDFILE, READWRITE };
+
+/* Pick the first method that kernel supports for given pair of files:
+ * splice(2) needs a pipe on either side, copy_file_range(2) works between
+ * regular files and sendfile(2) needs input that can be mapped. */
+static int copymethod(int in, int out) {
+  struct stat ist, ost;
+
+  if (fstat(in, &ist) < 0 || fstat(out, &ost) < 0)
+    return READWRITE;
+  if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode))
+    return SPLICE;
+  if (S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode))
+    return COPY_RANGE;
+  if (S_ISREG(ist.st_mode) || S_ISBLK(ist.st_mode))
+    return SENDFILE;
+  return READWRITE;
+}
+
+/* Copy all data from `in` to `out` without passing it through user space if
+ * possible. All methods advance file offsets, so whenever the kernel refuses
+ * to use one of them, the next one carries on where it stopped. */
+static int copyfd(int in, int out) {
+  int method = copymethod(in, out);
+  char *buf = NULL;
+  ssize_t n;
+
+  for (;;) {
+#ifdef LINUX
+    if (method == SPLICE)
+      n = splice(in, NULL, out, NULL, CATCHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+    else if (method == COPY_RANGE)
+      n = copy_file_range(in, NULL, out, NULL, CATCHUNK, 0);
+    else if (method == SENDFILE)
+      n = sendfile(out, in, NULL, CATCHUNK);
+    else
+#endif
+    {
+      if (buf == NULL)
+        buf = Malloc(CATBUFSZ);
+      if ((n = read(in, buf, CATBUFSZ)) > 0 && rio_writen(out, buf, n) < 0)
+        n = -1;
+    }
+
+    if (n > 0)
+      continue;
+    if (n == 0)
+      break;
+    /* EBADF comes from copy_file_range(2) when output is in append mode */
+    if (method != READWRITE && (errno == EINVAL || errno == ENOSYS ||
+                                errno == EXDEV || errno == EOPNOTSUPP ||
+                                errno == EBADF)) {
+      method++;
+      continue;
+    }
+    break;
+  }
+
+  free(buf);
+  /* reader of the output went away, which ends copying just like EOF */
+  if (n < 0 && errno == EPIPE)
+    return 0;
+  return n < 0 ? -1 : 0;
+}
+
+/*
+ * Concatenate files (or standard input) to standard output.
+ * Options are left to external 'cat'.
+ */
+static int do_cat(char **argv) {
+  static char *stdinv[] = {"-", NULL};
+  int exitcode = 0;
+
+  for (char **argp = argv; *argp; argp++)
+    if (**argp == '-' && (*argp)[1] != '\0')
+      return -1;
+
+  for (argv = *argv ? argv : stdinv; *argv; argv++) {
+    bool stdin_p = !strcmp(*argv, "-");
+    int fd = stdin_p ? STDIN_FILENO : open(*argv, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || copyfd(fd, STDOUT_FILENO) < 0) {
+      if (errno == EINTR) { /* interrupted by SIGINT */
+        exitcode = 128 + SIGINT;
+      } else {
+        msg("cat: %s: %s\n", *argv, strerror(errno));
+        exitcode = 1;
+      }
+    }
+
+    if (fd >= 0 && !stdin_p)
+      Close(fd);
+    if (exitcode > 128)
+      break;
+  }
+
+  return exitcode;
+}
+
+/* Duplicate data from `in` to every descriptor of `out`, the last one of
+ * which is standard output. If all of them are pipes, tee(2) copies the data
+ * to all but the last output without consuming it and splice(2) moves it to
+ * the last one. Data goes through a buffer only when an output pipe had no
+ * room for all of it, or when some descriptor isn't a pipe. */
+static int teefd(int in, int *out, int nout) {
+  bool pipes = true;
+  struct stat st;
+  ssize_t got[nout], n;
+
+  if (nout == 1)
+    return copyfd(in, out[0]);
+
+  for (int i = -1; i < nout; i++)
+    if (fstat(i < 0 ? in : out[i], &st) < 0 || !S_ISFIFO(st.st_mode))
+      pipes = false;
+
+  char *buf = Malloc(CATBUFSZ);
+
+  for (;;) {
+    memset(got, 0, sizeof(got));
+
+#ifdef LINUX
+    if (pipes) {
+      bool partial = false;
+
+      /* the first output decides how much data is passed in this round */
+      n = CATBUFSZ;
+      for (int i = 0; i < nout - 1 && n > 0; i++) {
+        if ((got[i] = tee(in, out[i], n, 0)) < 0 || i == 0)
+          n = got[i];
+        partial |= got[i] < n;
+      }
+      if (n <= 0)
+        break;
+
+      if (!partial) {
+        ssize_t m = 0;
+        for (ssize_t left = n; left > 0 && m >= 0; left -= m)
+          m = splice(in, NULL, out[nout - 1], NULL, left, SPLICE_F_MOVE);
+        if (m < 0)
+          break;
+        continue;
+      }
+
+      /* consume the data and write out what the outputs didn't get */
+      if ((n = rio_readn(in, buf, n)) <= 0)
+        break;
+    } else
+#endif
+    if ((n = read(in, buf, CATBUFSZ)) <= 0) {
+      break;
+    }
+
+    for (int i = 0; i < nout && n > 0; i++)
+      if (rio_writen(out[i], buf + got[i], n - got[i]) < 0)
+        n = -1;
+    if (n < 0)
+      break;
+  }
+
+  free(buf);
+  if (n < 0 && errno == EPIPE)
+    return 0;
+  return n < 0 ? -1 : 0;
+}
+
+/*
+ * Copy standard input to each file and to standard output, appending
+ * to files with `-a`. Other options are left to external 'tee'.
+ */
+static int do_tee(char **argv) {
+  bool append = false;
+  int exitcode = 0;
+
+  for (; *argv && **argv == '-' && (*argv)[1] != '\0'; argv++) {
+    if (strcmp(*argv, "-a"))
+      return -1;
+    append = true;
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+  int nfiles = 0;
+  while (argv[nfiles])
+    nfiles++;
+
+  int out[nfiles + 1], nout = 0;
+
+  for (; *argv; argv++) {
+    if ((out[nout] = open(*argv, flags, 0666)) < 0) {
+      msg("tee: %s: %s\n", *argv, strerror(errno));
+      exitcode = 1;
+    } else {
+      nout++;
+    }
+  }
+  out[nout++] = STDOUT_FILENO;
+
+  if (teefd(STDIN_FILENO, out, nout) < 0) {
+    if (errno == EINTR) {
+      exitcode = 128 + SIGINT;
+    } else {
+      msg("tee: %s\n", strerror(errno));
+      exitcode = 1;
+    }
+  }
+
+  for (int i = 0; i < nout - 1; i++)
+    Close(out[i]);
+  return exitcode;
+}
+
+/* Captured output of a command, kept in memory where possible. */
+static int outputfd(void) {
+#ifdef LINUX
+  return Memfd_create("parallel", MFD_CLOEXEC);
+#else
+  char path[] = "/tmp/shell-parallel.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+    unix_error("mkstemp error");
+  Unlink(path);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+#endif
+}
+
+typedef struct {
+  int job;    /* job number or -1 if the slot is free */
+  int out;    /* standard output of the job */
+  int err;    /* standard error of the job */
+  char *cmd;  /* command shown when it fails */
+} slot_t;
+
+/* Copy of `arg` with every {} replaced by `line`. */
+static char *substarg(const char *arg, const char *line) {
+  char *res = strdup("");
+  const char *braces;
+
+  while ((braces = strstr(arg, "{}"))) {
+    char *lit = strndup(arg, braces - arg);
+    strapp(&res, lit);
+    strapp(&res, line);
+    free(lit);
+    arg = braces + 2;
+  }
+  strapp(&res, arg);
+  return res;
+}
+
+#define PARALLEL_MAXJOBS 256 /* each running job holds two memfds */
+
+/* Start a command in background job of its own, with its output captured. */
+static void startslot(slot_t *slot, char *line, char **tmpl) {
+  char *lineargv[] = {line, NULL};
+  char **argv = lineargv;
+
+  if (tmpl) {
+    int n = 0;
+    bool subst = false;
+    while (tmpl[n])
+      n++;
+    argv = Calloc(n + 2, sizeof(char *));
+    for (int i = 0; i < n; i++) {
+      subst |= strstr(tmpl[i], "{}") != NULL;
+      argv[i] = substarg(tmpl[i], line);
+    }
+    if (!subst)
+      argv[n] = strdup(line);
+  }
+
+  slot->out = outputfd();
+  slot->err = outputfd();
+
+  pid_t pid = spawn();
+  if (pid == 0) {
+    int null = open("/dev/null", O_RDONLY);
+    setpgid(0, 0);
+    if (null >= 0) {
+      Dup2(null, STDIN_FILENO);
+      Close(null);
+    }
+    Dup2(slot->out, STDOUT_FILENO);
+    Dup2(slot->err, STDERR_FILENO);
+    subshell(line, tmpl ? argv : NULL);
+  }
+
+  setpgid(pid, pid);
+  slot->job = addjob(pid, BG);
+  addproc(slot->job, pid, argv);
+  slot->cmd = strdup(jobcmd(slot->job));
+  if (argv != lineargv) {
+    for (char **argp = argv; *argp; argp++)
+      free(*argp);
+    free(argv);
+  }
+}
+
+/* Write out output of a finished job as a whole. */
+static bool finishslot(slot_t *slot, int status) {
+  int exitcode = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                     : WEXITSTATUS(status);
+
+  Lseek(slot->out, 0, SEEK_SET);
+  Lseek(slot->err, 0, SEEK_SET);
+  (void)copyfd(slot->out, STDOUT_FILENO);
+  (void)copyfd(slot->err, STDERR_FILENO);
+  if (exitcode)
+    msg("parallel: '%s' failed, status=%d\n", slot->cmd, exitcode);
+
+  Close(slot->out);
+  Close(slot->err);
+  free(slot->cmd);
+  slot->job = -1;
+  return exitcode == 0;
+}
+
+/* As a pipeline stage 'parallel' would be killed by SIGINT, leaving its
+ * jobs behind. Instead it stops them, just like the shell does. */
+static void parallel_sigint(int sig) {
+  (void)sig;
+  interrupted = 1;
+}
+
+static uint64_t nsec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Run commands read from standard input as background jobs, at most N at a
+ * time ('-j N', number of CPUs by default). Each line is a command line, or
+ * an argument of the command given to 'parallel', which replaces every '{}'
+ * or is appended. Output of each command is written out as a whole when it
+ * finishes, then the number of failed commands and throughput is reported.
+ * Other options are left to external 'parallel'.
+ */
+static int do_parallel(char **argv) {
+  long njobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (; *argv && **argv == '-'; argv++) {
+    char *num = NULL;
+    if (!strcmp(*argv, "-j"))
+      num = *++argv;
+    else if (!strncmp(*argv, "-j", 2))
+      num = *argv + 2;
+    else
+      return -1;
+    if (num == NULL || (njobs = strtol(num, &num, 10)) <= 0 || *num) {
+      msg("parallel: -j needs a positive number\n");
+      return 2;
+    }
+  }
+  njobs = min(njobs, PARALLEL_MAXJOBS);
+
+  char **tmpl = *argv ? argv : NULL;
+  slot_t *slot = Malloc(sizeof(slot_t) * njobs);
+  for (int i = 0; i < njobs; i++)
+    slot[i].job = -1;
+
+  rio_t rio;
+  char *line = NULL;
+  size_t linesz = 0;
+  int nrunning = 0, nstarted = 0, nfailed = 0;
+  bool eof = false;
+  uint64_t start = nsec();
+
+  struct sigaction act = {.sa_handler = parallel_sigint}, oldact;
+  sigemptyset(&act.sa_mask);
+  Sigaction(SIGINT, &act, &oldact);
+
+  /* SIGCHLD is blocked when run as a pipeline stage, wait for it anyway */
+  sigset_t mask, waitmask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  waitmask = mask;
+  sigdelset(&waitmask, SIGCHLD);
+  /* input may trickle in line by line or come in bulk from a file */
+  rio_readinitb_size(&rio, STDIN_FILENO, RIO_ADAPTIVE);
+
+  for (;;) {
+    /* Fill free slots. Reading input is the only thing that may block. */
+    for (int i = 0; i < njobs && !eof && !interrupted; i++) {
+      if (slot[i].job >= 0)
+        continue;
+      ssize_t n;
+      while ((n = rio_getlineb(&rio, &line, &linesz)) > 0) {
+        if (line[n - 1] == '\n')
+          line[--n] = '\0';
+        if (n > 0) /* skip empty lines */
+          break;
+      }
+      if (n <= 0) {
+        eof = true;
+        break;
+      }
+      startslot(&slot[i], line, tmpl);
+      nstarted++;
+      nrunning++;
+    }
+
+    if (nrunning == 0)
+      break;
+
+    Sigsuspend(&waitmask);
+
+    for (int i = 0; i < njobs; i++) {
+      int status;
+      if (slot[i].job < 0)
+        continue;
+      if (interrupted)
+        killjob(slot[i].job);
+      if (jobstate(slot[i].job, &status) != FINISHED)
+        continue;
+      nfailed += !finishslot(&slot[i], status);
+      nrunning--;
+    }
+  }
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  Sigaction(SIGINT, &oldact, NULL);
+  rio_closeb(&rio);
+  free(line);
+  free(slot);
+
+  double secs = (nsec() - start) / 1e9;
+  msg("parallel: %d jobs in %.2fs (%.1f jobs/s), %d failed\n", nstarted, secs,
+      secs > 0 ? nstarted / secs : 0, nfailed);
+
+  if (interrupted)
+    return 128 + SIGINT;
+  return nfailed ? 1 : 0;
+}
+
 static command_t builtins[] = {
-  {"quit", do_quit}, {"cd", do_chdir},  {"jobs", do_jobs}, {"fg", do_fg},
-  {"bg", do_bg},     {"kill", do_kill}, {NULL, NULL},
+  {"quit", do_quit},   {"cd", do_chdir},  {"jobs", do_jobs}, {"fg", do_fg},
+  {"bg", do_bg},       {"kill", do_kill}, {"true", do_true}, {":", do_true},
+  {"false", do_false}, {"cat", do_cat},   {"tee", do_tee},
+  {"parallel", do_parallel}, {NULL, NULL},
 };
 
+/* Tells if `name` is a builtin, though some of its uses may still be left to
+ * the external command. */
+bool builtin_p(const char *name) {
+  for (command_t *cmd = builtins; cmd->name; cmd++)
+    if (!strcmp(name, cmd->name))
+      return true;
+  return false;
+}
+
 int builtin_command(char **argv) {
   for (command_t *cmd = builtins; cmd->name; cmd++) {
     if (strcmp(argv[0], cmd->name))
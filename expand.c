@@ -0,0 +1,94 @@
+#include "shell.h"
+
+/* Shell variables are kept in the environment, so every assignment is
+ * visible to subsequently started commands. */
+
+int lastexitcode = 0;      /* value of $? */
+static char **params;      /* $0, $1, ... */
+static int nparams;        /* value of $# */
+
+/* Set positional parameters $1..$n, `argv[0]` becomes $0 if it's given.
+ * Returns previous parameters, so they can be restored later. */
+char **setparams(char **argv, int argc, int *oldargcp) {
+  char **old = params;
+  if (oldargcp)
+    *oldargcp = nparams;
+  params = argv;
+  nparams = argc;
+  return old;
+}
+
+static bool namechar_p(int c) {
+  return isalnum(c) || c == '_';
+}
+
+/* Checks if a word has NAME=value form. */
+bool assignment_p(const char *word) {
+  if (!isalpha((unsigned char)*word) && *word != '_')
+    return false;
+  while (namechar_p((unsigned char)*word))
+    word++;
+  return *word == '=';
+}
+
+static void lookup(char **resp, const char *name, size_t len) {
+  char buf[16];
+  const char *val = NULL;
+
+  if (len == 1 && isdigit((unsigned char)*name)) {
+    int n = *name - '0';
+    if (n <= nparams && params)
+      val = params[n];
+  } else if (len == 1 && *name == '?') {
+    snprintf(buf, sizeof(buf), "%d", lastexitcode);
+    val = buf;
+  } else if (len == 1 && *name == '#') {
+    snprintf(buf, sizeof(buf), "%d", nparams);
+    val = buf;
+  } else {
+    char *var = strndup(name, len);
+    val = getenv(var);
+    free(var);
+  }
+
+  if (val)
+    strapp(resp, val);
+}
+
+/* Expand $NAME, ${NAME}, $0..$9, $# and $? references in a word.
+ * Unset variables expand to an empty string. Result must be freed. */
+char *expand(const char *word) {
+  char *res = strdup("");
+
+  while (*word) {
+    size_t n = strcspn(word, "$");
+    char *lit = strndup(word, n);
+    strapp(&res, lit);
+    free(lit);
+    word += n;
+
+    if (*word == '\0')
+      break;
+
+    const char *name = ++word;
+    if (*name == '{' && strchr(name, '}')) {
+      name++;
+      n = strchr(name, '}') - name;
+      word = name + n + 1;
+    } else if (isdigit((unsigned char)*name) || *name == '?' || *name == '#') {
+      n = 1;
+      word = name + 1;
+    } else if (isalpha((unsigned char)*name) || *name == '_') {
+      for (n = 0; namechar_p((unsigned char)name[n]); n++)
+        continue;
+      word = name + n;
+    } else {
+      strapp(&res, "$");
+      continue;
+    }
+
+    lookup(&res, name, n);
+  }
+
+  return res;
+}
@@ -0,0 +1,12 @@
+# variables, loops, groups and functions
+NAME=value
+echo $NAME ${NAME} $1 $# $?
+for i in 1 2 3; do echo $i; done
+while false; do echo never; done
+{ echo a; echo b; } && echo group
+greet() { echo hello $1; }
+greet world
+for f in a b
+do
+  { echo $f ; } || echo never
+done
@@ -0,0 +1,8 @@
+# pipelines, lists and background jobs
+ls -l /usr/bin | grep sh | sort -k5 -n | tail -3
+sleep 1 & sleep 2 & jobs
+false || echo failed && echo done ; ! true
+producer |{65536} consumer | wc -l
+cat <(ls /) >(wc -c) | tee >(head -1) > /dev/null
+coproc cat
+seq 1 10 | parallel -j 4 echo {}
@@ -0,0 +1,14 @@
+# redirections and here-documents
+echo out > /tmp/out 2> /tmp/err
+cat < /etc/passwd >> /tmp/log
+exec 3>> /tmp/log
+echo to three >&3
+exec 3>&-
+cmd 2>&1 >&- <> /tmp/rw &> /tmp/all
+cat << EOF
+line $HOME
+EOF
+cat <<< here-string
+> /tmp/truncated; echo after
+< /etc/passwd | cat
+> /tmp/last
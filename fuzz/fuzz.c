@@ -0,0 +1,68 @@
+#include "shell.h"
+
+/* Fuzzing harness: input is checked as command lines the way `shell -n`
+ * does it. Lexer, here-documents, syntax checks, redirections and process
+ * substitutions get exercised, but no file gets opened and nothing is run. */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char *cmds = strndup((const char *)data, size);
+  (void)checkcmds(cmds);
+  free(cmds);
+  return 0;
+}
+
+#ifdef FUZZ_MAIN
+/* Without libFuzzer each file given as an argument is checked BENCHROUNDS
+ * times and throughput is reported, so lexer changes can be timed on the
+ * fuzzing corpus. With no arguments standard input is checked once, which
+ * is how AFL runs its targets. */
+#define BENCHROUNDS 20000
+
+static char *readall(int fd, size_t *sizep) {
+  size_t size = 0, cap = 4096;
+  char *buf = Malloc(cap);
+  ssize_t n;
+
+  while ((n = Read(fd, buf + size, cap - size)) > 0) {
+    size += n;
+    if (size == cap)
+      buf = Realloc(buf, cap *= 2);
+  }
+  *sizep = size;
+  return buf;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  size_t size;
+  char *data;
+
+  if (argc < 2) {
+    data = readall(STDIN_FILENO, &size);
+    LLVMFuzzerTestOneInput((uint8_t *)data, size);
+    free(data);
+    return 0;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    int fd = Open(argv[i], O_RDONLY, 0);
+    data = readall(fd, &size);
+    Close(fd);
+
+    double start = now();
+    for (int r = 0; r < BENCHROUNDS; r++)
+      LLVMFuzzerTestOneInput((uint8_t *)data, size);
+    double secs = now() - start;
+
+    printf("%s: %zu bytes x %d in %.3fs, %.1f MB/s\n", argv[i], size,
+           BENCHROUNDS, secs, size * BENCHROUNDS / secs / 1e6);
+    free(data);
+  }
+  return 0;
+}
+#endif /* !FUZZ_MAIN */
@@ -21,7 +21,10 @@
 #include <fcntl.h>
 #include <grp.h>
 #include <limits.h>
+/* With _GNU_SOURCE glibc declares its own gai_error(3), rename it away. */
+#define gai_error __glibc_gai_error
 #include <netdb.h>
+#undef gai_error
 #include <netinet/in.h>
 #include <poll.h>
 #include <pthread.h>
@@ -29,6 +32,7 @@
 #include <semaphore.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -83,6 +87,11 @@ noreturn void gai_error(int code, const char *fmt, ...)
 /* Signal safe I/O functions */
 void safe_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void safe_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int safe_snprintf(char *buf, size_t size, const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+int safe_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
+void safe_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void safe_log_flush(int fd);
 
 /* Decent hashing function. */
 #define HASHINIT 5381
@@ -129,6 +138,10 @@ void Ftruncate(int fd, off_t length);
 int Dup(int fd);
 int Dup2(int oldfd, int newfd);
 void Pipe(int fds[2]);
+#ifdef LINUX
+void Pipe2(int fds[2], int flags);
+int Memfd_create(const char *name, unsigned flags);
+#endif
 void Socketpair(int domain, int type, int protocol, int sv[2]);
 int Select(int n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
            struct timeval *timeout);
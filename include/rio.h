@@ -3,25 +3,42 @@
 
 /* Persistent state for the robust I/O (Rio) package */
 #define RIO_BUFSIZE 8192
+#define RIO_MINBUFSIZE 512
+#define RIO_MAXBUFSIZE (1 << 20)
+#define RIO_ADAPTIVE 0 /* buffer size that adapts to the stream */
 
 typedef struct {
   int rio_fd;                /* Descriptor for this internal buf */
   int rio_cnt;               /* Unread bytes in internal buf */
   char *rio_bufptr;          /* Next unread byte in internal buf */
-  char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+  char *rio_buf;             /* Internal buffer or NULL until first read */
+  size_t rio_bufsize;        /* Size of internal buffer */
+  bool rio_adaptive;         /* Resize buffer according to reads? */
+  int rio_streak;            /* Full (> 0) or sparse (< 0) reads in a row */
+  struct rio_ring *rio_ring; /* Reads queued in io_uring or NULL */
+  struct rio_map *rio_map;   /* Mapped window of regular file or NULL */
 } rio_t;
 
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, const void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd);
+void rio_readinitb_size(rio_t *rp, int fd, size_t size);
+void rio_readinitb_ring(rio_t *rp, int fd, int depth);
+void rio_readinitb_map(rio_t *rp, int fd);
+void rio_closeb(rio_t *rp);
+void rio_idleb(rio_t *rp);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_getlineb(rio_t *rp, char **linep, size_t *np);
+ssize_t rio_fetchlineb(rio_t *rp, char **linep);
 
 /* Wrappers that exit on failure */
 ssize_t Rio_readn(int fd, void *ptr, size_t nbytes);
 void Rio_writen(int fd, const void *usrbuf, size_t n);
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_getlineb(rio_t *rp, char **linep, size_t *np);
+ssize_t Rio_fetchlineb(rio_t *rp, char **linep);
 
 #endif /* !_RIO_H_ */
@@ -3,7 +3,8 @@
 typedef struct proc {
   pid_t pid;    /* process identifier */
   int state;    /* RUNNING or STOPPED or FINISHED */
-  int exitcode; /* -1 if exit status not yet received */
+  int exitcode; /* wait status if finished or stopped, -1 if none yet */
+  bool aux;     /* relay or substituted command, exit status doesn't matter */
 } proc_t;
 
 typedef struct job {
@@ -13,12 +14,47 @@ typedef struct job {
   int nproc;             /* number of processes */
   int state;             /* changes when live processes have same state */
   char *command;         /* textual representation of command line */
+  pipestat_t *stat;      /* flow through pipes if measured, or NULL */
+  bool pipefail;         /* first failed process decides the exit status */
+  int failed;            /* index of first failed process or -1 */
+  unsigned queued;       /* place in admission queue, 0 if not queued */
 } job_t;
 
 static job_t *jobs = NULL;          /* array of all jobs */
-static int njobmax = 1;             /* number of slots in jobs array */
+static int njobmax = 0;             /* number of slots in jobs array */
 static int tty_fd = -1;             /* controlling terminal file descriptor */
 static struct termios shell_tmodes; /* saved shell terminal modes */
+static unsigned lastqueued = 0;     /* place of the last job queued */
+
+/* Sends `sig` to all processes of the job. Jobs that stay in the shell's
+ * process group get it one by one, so that it doesn't reach the shell.
+ * Only async-signal-safe functions are used, it's called by the timer. */
+static void signaljob(job_t *job, int sig) {
+  if (job->pgid != getpgrp()) {
+    kill(-job->pgid, sig);
+    return;
+  }
+  for (int p = 0; p < job->nproc; p++)
+    if (job->proc[p].state != FINISHED)
+      kill(job->proc[p].pid, sig);
+}
+
+/* In pipefail mode the first process that fails decides the exit status of
+ * the job. Stages upstream of it are terminated at once, rather than when
+ * they write to a pipe with no reader, which may take long if ever. */
+static void pipefail(job_t *job, int p) {
+  int status = job->proc[p].exitcode;
+
+  if (job->failed >= 0 || job->proc[p].aux)
+    return;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    return;
+
+  job->failed = p;
+  for (int q = 0; q < p; q++)
+    if (job->proc[q].state != FINISHED)
+      kill(job->proc[q].pid, SIGTERM);
+}
 
 static void sigchld_handler(int sig) {
   int old_errno = errno;
@@ -58,12 +94,21 @@ static void sigchld_handler(int sig) {
       }
 
       pid =
-        Waitpid(jobs[j].proc[p].pid, &status, WNOHANG | WUNTRACED | WCONTINUED);
+        waitpid(jobs[j].proc[p].pid, &status, WNOHANG | WUNTRACED | WCONTINUED);
 
       switch (pid) {
         case -1:
+          // not our child, i.e. a job of the shell copied into a subshell
+          if (errno == ECHILD) {
+            jobs[j].proc[p].state = FINISHED;
+            break;
+          }
           // error, this process is finished or dosen't exist
-          msg("sigchld_handler: waitpid failed\n");
+          // handler can't print, the message is written out by bflush
+          safe_log("sigchld_handler: waitpid(%d) failed, errno=%d\n",
+                   (int)jobs[j].proc[p].pid, errno);
+          Sigprocmask(SIG_SETMASK, &old_mask, NULL);
+          errno = old_errno;
           return;
           break;
 
@@ -79,9 +124,12 @@ static void sigchld_handler(int sig) {
           if (WIFEXITED(status) || WIFSIGNALED(status)) {
             jobs[j].proc[p].state = FINISHED;
             jobs[j].proc[p].exitcode = status;
+            if (jobs[j].pipefail)
+              pipefail(&jobs[j], p);
             // if the process was stopped
           } else if (WIFSTOPPED(status)) {
             jobs[j].proc[p].state = STOPPED;
+            jobs[j].proc[p].exitcode = status;
             jobs[j].state = STOPPED;
             procs_unfinished++;
             // if the process was continued
@@ -105,9 +153,16 @@ static void sigchld_handler(int sig) {
   errno = old_errno;
 }
 
-/* When pipeline is done, its exitcode is fetched from the last process. */
+/* When pipeline is done, its exitcode is fetched from the last process,
+ * or from the first one that failed in pipefail mode. */
 static int exitcode(job_t *job) {
-  return job->proc[job->nproc - 1].exitcode;
+  if (job->failed >= 0)
+    return job->proc[job->failed].exitcode;
+
+  int p = job->nproc - 1;
+  while (p > 0 && job->proc[p].aux)
+    p--;
+  return job->proc[p].exitcode;
 }
 
 static int allocjob(void) {
@@ -129,6 +184,12 @@ static int allocproc(int j) {
 }
 
 int addjob(pid_t pgid, int bg) {
+  /* Job table is allocated when the first job gets started. */
+  if (jobs == NULL) {
+    jobs = calloc(sizeof(job_t), 1);
+    njobmax = 1;
+  }
+
   int j = bg ? allocjob() : FG;
   job_t *job = &jobs[j];
   /* Initial state of a job. */
@@ -138,6 +199,10 @@ int addjob(pid_t pgid, int bg) {
   job->proc = NULL;
   job->nproc = 0;
   job->tmodes = shell_tmodes;
+  job->stat = NULL;
+  job->pipefail = false;
+  job->failed = -1;
+  job->queued = 0;
   return j;
 }
 
@@ -145,10 +210,14 @@ static void deljob(job_t *job) {
   assert(job->state == FINISHED);
   free(job->command);
   free(job->proc);
+  if (job->stat)
+    pipestat_free(job->stat);
   job->pgid = 0;
   job->command = NULL;
   job->proc = NULL;
   job->nproc = 0;
+  job->stat = NULL;
+  job->queued = 0;
 }
 
 static void movejob(int from, int to) {
@@ -161,7 +230,9 @@ static void mkcommand(char **cmdp, char **argv) {
   if (*cmdp)
     strapp(cmdp, " | ");
 
-  for (strapp(cmdp, *argv++); *argv; argv++) {
+  /* a stage that only makes redirections has no words */
+  strapp(cmdp, *argv ? *argv++ : "");
+  for (; *argv; argv++) {
     strapp(cmdp, " ");
     strapp(cmdp, *argv);
   }
@@ -177,12 +248,78 @@ void addproc(int j, pid_t pid, char **argv) {
   proc->pid = pid;
   proc->state = RUNNING;
   proc->exitcode = -1;
-  mkcommand(&job->command, argv);
+  /* processes without arguments are hidden from the user */
+  proc->aux = argv == NULL;
+  if (argv)
+    mkcommand(&job->command, argv);
+}
+
+void setjobstat(int j, pipestat_t *ps) {
+  assert(j < njobmax);
+  jobs[j].stat = ps;
+}
+
+void setjobpipefail(int j) {
+  assert(j < njobmax);
+  jobs[j].pipefail = true;
+}
+
+/* Job was held back by admission control, see admit.c. */
+void queuejob(int j) {
+  jobs[j].queued = ++lastqueued;
+  admittimer(true);
+}
+
+bool queuedjobs(void) {
+  for (int j = BG; j < njobmax; j++)
+    if (jobs[j].queued && jobs[j].state != FINISHED)
+      return true;
+  return false;
+}
+
+/* Queued job can be continued once all its processes have stopped, otherwise
+ * SIGCONT could come before some of them stop themselves. */
+static bool heldjob(job_t *job) {
+  for (int p = 0; p < job->nproc; p++)
+    if (job->proc[p].state == RUNNING && !job->proc[p].aux)
+      return false;
+  return true;
+}
+
+/* Called by the admission timer. Continues the oldest queued job if there's
+ * no pressure. Returns whether there are still jobs in the queue. */
+bool releasejob(void) {
+  job_t *oldest = NULL;
+  int left = 0;
+
+  for (int j = BG; j < njobmax; j++) {
+    job_t *job = &jobs[j];
+    if (!job->queued || job->state == FINISHED)
+      continue;
+    left++;
+    if (!oldest || job->queued < oldest->queued)
+      oldest = job;
+  }
+
+  if (!oldest || !heldjob(oldest) || !pressure_ok())
+    return left > 0;
+
+  oldest->queued = 0;
+  signaljob(oldest, SIGCONT);
+  return left > 1;
+}
+
+/* Report flow through pipes of jobs that measure it. Report is written out
+ * together with the job table by `watchjobs`. */
+void statjobs(void) {
+  for (int j = 0; j < njobmax; j++)
+    if (jobs[j].pgid && jobs[j].stat)
+      pipestat_print(j, jobs[j].stat);
 }
 
 /* Returns job's state.
  * If it's finished, delete it and return exitcode through statusp. */
-static int jobstate(int j, int *statusp) {
+int jobstate(int j, int *statusp) {
   assert(j < njobmax);
   job_t *job = &jobs[j];
   int state = job->state;
@@ -192,8 +329,14 @@ static int jobstate(int j, int *statusp) {
   (void)exitcode;
 
   *statusp = exitcode(job);
+  // stopped job reports how one of its processes got stopped
+  for (int p = 0; state == STOPPED && p < job->nproc; p++)
+    if (job->proc[p].state == STOPPED)
+      *statusp = job->proc[p].exitcode;
   // if the job is finished, delete it
   if (state == FINISHED) {
+    if (job->stat)
+      pipestat_print(j, job->stat);
     deljob(job);
   }
 #endif /* !STUDENT */
@@ -215,9 +358,17 @@ bool resumejob(int j, int bg, sigset_t *mask) {
       continue;
   }
 
-  if (j >= njobmax || jobs[j].state == FINISHED)
+  /* No jobs were started yet, or the table was dropped by a subshell. */
+  if (j < BG || j >= njobmax || jobs[j].state == FINISHED)
     return false;
 
+  /* Resumed by hand, so it doesn't wait for admission anymore. */
+  if (jobs[j].queued) {
+    jobs[j].queued = 0;
+    while (!heldjob(&jobs[j]))
+      Sigsuspend(mask);
+  }
+
     /* TODO: Continue stopped job. Possibly move job to foreground slot. */
 #ifdef STUDENT
   (void)movejob;
@@ -231,7 +382,7 @@ bool resumejob(int j, int bg, sigset_t *mask) {
 
     monitorjob(mask);
   } else if (jobs[j].state == STOPPED) {
-    Kill(-jobs[j].pgid, SIGCONT);
+    signaljob(&jobs[j], SIGCONT);
   }
 
 #endif /* !STUDENT */
@@ -241,7 +392,7 @@ bool resumejob(int j, int bg, sigset_t *mask) {
 
 /* Kill the job by sending it a SIGTERM. */
 bool killjob(int j) {
-  if (j >= njobmax || jobs[j].state == FINISHED)
+  if (j < BG || j >= njobmax || jobs[j].state == FINISHED)
     return false;
   debug("[%d] killing '%s'\n", j, jobs[j].command);
 
@@ -252,14 +403,16 @@ bool killjob(int j) {
   if (state == STOPPED) {
     // we need to attach the terminal to the job
     // because it might recieve SIGTTIN or SIGTTOU
-    Tcsetattr(tty_fd, TCSADRAIN, &jobs[j].tmodes);
+    if (tty_fd >= 0)
+      Tcsetattr(tty_fd, TCSADRAIN, &jobs[j].tmodes);
     setfgpgrp(jobs[j].pgid);
-    Kill(-jobs[j].pgid, SIGTERM);
-    Kill(-jobs[j].pgid, SIGCONT);
+    signaljob(&jobs[j], SIGTERM);
+    signaljob(&jobs[j], SIGCONT);
     setfgpgrp(getpgrp());
-    Tcsetattr(tty_fd, TCSADRAIN, &shell_tmodes);
+    if (tty_fd >= 0)
+      Tcsetattr(tty_fd, TCSADRAIN, &shell_tmodes);
   } else {
-    Kill(-jobs[j].pgid, SIGTERM);
+    signaljob(&jobs[j], SIGTERM);
   }
 #endif /* !STUDENT */
 
@@ -285,18 +438,23 @@ void watchjobs(int which) {
       // print the message according to the state
       if (state == FINISHED) {
         if (WIFSIGNALED(status)) {
-          msg("[%d] killed '%s' by signal %d\n", j, cmd, WTERMSIG(status));
+          bmsg("[%d] killed '%s' by signal %d\n", j, cmd, WTERMSIG(status));
         } else {
-          msg("[%d] exited '%s', status=%d\n", j, cmd, WEXITSTATUS(status));
+          bmsg("[%d] exited '%s', status=%d\n", j, cmd, WEXITSTATUS(status));
         }
       } else {
-        msg("[%d] %s '%s'\n", j,
-            jobs[j].state == STOPPED ? "suspended" : "running", cmd);
+        bmsg("[%d] %s '%s'\n", j,
+             jobs[j].queued               ? "queued"
+             : jobs[j].state == STOPPED ? "suspended"
+                                        : "running",
+             cmd);
       }
       free(cmd);
     }
 #endif /* !STUDENT */
   }
+
+  bflush();
 }
 
 /* Monitor job execution. If it gets stopped move it to background.
@@ -310,14 +468,18 @@ int monitorjob(sigset_t *mask) {
   (void)exitcode;
   (void)state;
 
-  // saving current terminal modes
-  Tcgetattr(tty_fd, &shell_tmodes);
-  // setting terminal modes of the job
-  Tcsetattr(tty_fd, TCSADRAIN, &jobs[FG].tmodes);
+  if (tty_fd >= 0) {
+    // saving current terminal modes
+    Tcgetattr(tty_fd, &shell_tmodes);
+    // setting terminal modes of the job
+    Tcsetattr(tty_fd, TCSADRAIN, &jobs[FG].tmodes);
+  }
   // setting the foreground process group
   setfgpgrp(jobs[FG].pgid);
-  // sending SIGCONT to the job to continue it if it recieved SIGTTIN or SIGTTOU
-  Kill(-jobs[FG].pgid, SIGCONT);
+  // sending SIGCONT to the job to continue it if it recieved SIGTTIN or SIGTTOU,
+  // without job control only a stopped job needs it
+  if (tty_fd >= 0 || jobs[FG].state == STOPPED)
+    signaljob(&jobs[FG], SIGCONT);
 
   while (1) {
     // waiting for change
@@ -328,25 +490,38 @@ int monitorjob(sigset_t *mask) {
     // the loop
     if (state == STOPPED) {
       // restoring terminal modes
-      Tcgetattr(tty_fd, &jobs[FG].tmodes);
+      if (tty_fd >= 0)
+        Tcgetattr(tty_fd, &jobs[FG].tmodes);
       // moving the job to the background
       movejob(0, allocjob());
       break;
     } else if (state == FINISHED) {
+      bflush(); /* flow through pipes of the job */
       break;
     }
   }
   // restoring shell as the foreground process group
   setfgpgrp(getpgrp());
   // restoring terminal modes
-  Tcsetattr(tty_fd, TCSAFLUSH, &shell_tmodes);
+  if (tty_fd >= 0)
+    Tcsetattr(tty_fd, TCSAFLUSH, &shell_tmodes);
+
+  // convert wait status to exit status the way other shells report it
+  if (state == STOPPED)
+    exitcode = 128 + WSTOPSIG(exitcode);
+  else if (WIFSIGNALED(exitcode))
+    exitcode = 128 + WTERMSIG(exitcode);
+  else
+    exitcode = WEXITSTATUS(exitcode);
 #endif /* !STUDENT */
 
   return exitcode;
 }
 
-/* Called just at the beginning of shell's life. */
-void initjobs(void) {
+/* Called just at the beginning of shell's life. Without a terminal (script or
+ * piped commands) there's no job control: jobs stay in the shell's process
+ * group, see `jobpgrp`, and the shell never hands over the terminal. */
+void initjobs(bool interactive) {
   struct sigaction act = {
     .sa_flags = SA_RESTART,
     .sa_handler = sigchld_handler,
@@ -356,15 +531,17 @@ void initjobs(void) {
    * in case `sigint_handler` does something crazy like `longjmp`. */
   sigemptyset(&act.sa_mask);
   sigaddset(&act.sa_mask, SIGINT);
+  /* Admission timer looks at the job table, see admit.c. */
+  sigaddset(&act.sa_mask, SIGADMIT);
   Sigaction(SIGCHLD, &act, NULL);
 
-  jobs = calloc(sizeof(job_t), 1);
+  if (!interactive)
+    return;
 
   /* Assume we're running in interactive mode, so move us to foreground.
    * Duplicate terminal fd, but do not leak it to subprocesses that execve. */
   assert(isatty(STDIN_FILENO));
-  tty_fd = Dup(STDIN_FILENO);
-  fcntl(tty_fd, F_SETFD, FD_CLOEXEC);
+  tty_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, NREDIRFD);
 
   /* Take control of the terminal. */
   Tcsetpgrp(tty_fd, getpgrp());
@@ -383,26 +560,65 @@ void shutdownjobs(void) {
 
   for (int j = 0; j < njobmax; j++) {
     // avoid free slots
-    if (jobs[j].pgid != 0) {
-      while (jobs[j].state != FINISHED) {
-        // kill
-        killjob(j);
-        // wait
-        Sigsuspend(&mask);
+    if (jobs[j].pgid == 0 || jobs[j].state == FINISHED)
+      continue;
+    // scripts leave their jobs running, like other shells do, but held ones
+    // must be let go, as no one would ever release them
+    if (tty_fd < 0) {
+      if (jobs[j].queued) {
+        while (!heldjob(&jobs[j]))
+          Sigsuspend(&mask);
+        signaljob(&jobs[j], SIGCONT);
       }
+      continue;
+    }
+    while (jobs[j].state != FINISHED) {
+      // kill
+      killjob(j);
+      // wait
+      Sigsuspend(&mask);
     }
   }
-  watchjobs(ALL);
+  if (tty_fd >= 0)
+    watchjobs(ALL);
 #endif /* !STUDENT */
 
   watchjobs(FINISHED);
 
   Sigprocmask(SIG_SETMASK, &mask, NULL);
 
-  Close(tty_fd);
+  if (tty_fd >= 0)
+    Close(tty_fd);
+}
+
+/* Subprocess that runs shell commands by itself (a function in a pipeline or
+ * in the background) starts with no jobs and leaves the terminal alone. */
+void subshelljobs(void) {
+  for (int j = 0; j < njobmax; j++) {
+    free(jobs[j].command);
+    free(jobs[j].proc);
+  }
+  free(jobs);
+  jobs = NULL;
+  njobmax = 0;
+
+  if (tty_fd >= 0) {
+    Close(tty_fd);
+    tty_fd = -1;
+  }
+}
+
+/* Process group of a new job whose first process is `pid`, which is 0 in the
+ * process itself. With job control each job gets its own group.
+ * Otherwise jobs stay in the shell's one, like in other shells run without
+ * -m, so that a script run from a terminal is in the foreground as a whole
+ * and its commands can read the terminal without getting SIGTTIN. */
+pid_t jobpgrp(pid_t pid) {
+  return tty_fd >= 0 ? pid : getpgrp();
 }
 
 /* Sets foreground process group to `pgid`. */
 void setfgpgrp(pid_t pgid) {
-  Tcsetpgrp(tty_fd, pgid);
+  if (tty_fd >= 0)
+    Tcsetpgrp(tty_fd, pgid);
 }
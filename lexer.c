@@ -12,6 +12,27 @@ void strapp(char **dstp, const char *src) {
   }
 }
 
+/* Checks if the word that ends at `s` is a descriptor number. */
+static bool fdnum_p(token_t word, char *s) {
+  if (!string_p(word) || word == s)
+    return false;
+  for (; word < s; word++)
+    if (!isdigit((unsigned char)*word))
+      return false;
+  return true;
+}
+
+/* Returns the parenthesis that closes the one at `s` or NULL. */
+static char *closeparen(char *s) {
+  for (int depth = 0; *s; s++) {
+    if (*s == '(')
+      depth++;
+    else if (*s == ')' && --depth == 0)
+      return s;
+  }
+  return NULL;
+}
+
 token_t *tokenize(char *s, int *tokc_p) {
   int capacity = 10;
   int ntoks = 0;
@@ -20,30 +41,62 @@ token_t *tokenize(char *s, int *tokc_p) {
 
   while (*s != 0) {
     /* Consume whitespace characters. */
-    if (isspace(*s)) {
+    if (isspace((unsigned char)*s)) {
       *s++ = 0;
       continue;
     }
 
-    /* Make sure there's enough space to add new token. */
-    if (ntoks == capacity) {
+    /* Comment extends till the end of line. */
+    if (*s == '#')
+      break;
+
+    /* Make sure there's enough space to add new tokens. */
+    if (ntoks + 3 > capacity) {
       capacity *= 2;
       tokvec = realloc(tokvec, sizeof(token_t) * (capacity + 1));
     }
 
-    size_t l = strcspn(s, " |&<>;!");
+    size_t l = strcspn(s, " \t\n|&<>;!");
     if (l > 0) {
       tokvec[ntoks++] = s;
       s += l;
       continue;
     }
 
+    /* Process substitution, its command is lexed when it gets started. */
+    char *end;
+    if ((s[0] == '<' || s[0] == '>') && s[1] == '(' &&
+        (end = closeparen(s + 1))) {
+      tokvec[ntoks++] = s[0] == '<' ? T_PSUBIN : T_PSUBOUT;
+      tokvec[ntoks++] = s + 2;
+      s[0] = s[1] = *end = 0;
+      s = end + 1;
+      continue;
+    }
+
+    /* Redirection of a given descriptor, the number must touch operator. */
+    if ((s[0] == '<' || s[0] == '>') && ntoks > 0 &&
+        fdnum_p(tokvec[ntoks - 1], s)) {
+      tokvec[ntoks] = tokvec[ntoks - 1];
+      tokvec[ntoks - 1] = T_FD;
+      ntoks++;
+    }
+
     token_t tok;
 
     if (s[0] == '|') {
+      size_t n = s[1] == '{' ? strcspn(s + 2, "} \t\n|&<>;!") : 0;
       if (s[1] == '|') {
         *s++ = 0;
         tok = T_OR;
+      } else if (s[1] == '{' && s[2 + n] == '}') {
+        /* Pipe with buffer size given in braces, e.g. `|{1M}`. */
+        tokvec[ntoks++] = T_PIPE;
+        tokvec[ntoks++] = T_PIPESZ;
+        tokvec[ntoks++] = s + 2;
+        s[0] = s[1] = s[2 + n] = 0;
+        s += 3 + n;
+        continue;
       } else {
         tok = T_PIPE;
       }
@@ -51,13 +104,39 @@ token_t *tokenize(char *s, int *tokc_p) {
       if (s[1] == '&') {
         *s++ = 0;
         tok = T_AND;
+      } else if (s[1] == '>') {
+        *s++ = 0;
+        tok = T_OUTERR;
       } else {
         tok = T_BGJOB;
       }
     } else if (s[0] == '<') {
-      tok = T_INPUT;
+      if (s[1] == '<' && s[2] == '<') {
+        *s++ = 0;
+        *s++ = 0;
+        tok = T_HERESTR;
+      } else if (s[1] == '<') {
+        *s++ = 0;
+        tok = T_HEREDOC;
+      } else if (s[1] == '&') {
+        *s++ = 0;
+        tok = T_DUPIN;
+      } else if (s[1] == '>') {
+        *s++ = 0;
+        tok = T_RDWR;
+      } else {
+        tok = T_INPUT;
+      }
     } else if (s[0] == '>') {
-      tok = T_OUTPUT;
+      if (s[1] == '>') {
+        *s++ = 0;
+        tok = T_APPEND;
+      } else if (s[1] == '&') {
+        *s++ = 0;
+        tok = T_DUPOUT;
+      } else {
+        tok = T_OUTPUT;
+      }
     } else if (s[0] == ';') {
       tok = T_COLON;
     } else if (s[0] == '!') {
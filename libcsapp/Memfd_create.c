@@ -0,0 +1,10 @@
+#include "csapp.h"
+
+#ifdef LINUX
+int Memfd_create(const char *name, unsigned flags) {
+  int fd = memfd_create(name, flags);
+  if (fd < 0)
+    unix_error("Memfd_create error");
+  return fd;
+}
+#endif
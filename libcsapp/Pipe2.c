@@ -0,0 +1,8 @@
+#include "csapp.h"
+
+#ifdef LINUX
+void Pipe2(int fds[2], int flags) {
+  if (pipe2(fds, flags) < 0)
+    unix_error("Pipe2 error");
+}
+#endif
@@ -1,6 +1,11 @@
 #include "csapp.h"
 #include "rio.h"
 
+#ifdef LINUX
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
 /* rio_readn - Robustly read n bytes (unbuffered) */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n) {
   size_t nleft = n;
@@ -48,10 +53,347 @@ ssize_t rio_writen(int fd, const void *usrbuf, size_t n) {
 }
 
 void Rio_writen(int fd, const void *usrbuf, size_t n) {
-  if (rio_writen(fd, usrbuf, n) != n)
+  if (rio_writen(fd, usrbuf, n) != (ssize_t)n)
     unix_error("Rio_writen error");
 }
 
+#ifdef LINUX
+/*
+ * Reads queued in io_uring. A regular file gets up to `depth` reads in
+ * flight at consecutive offsets, so following buffers are being filled while
+ * the caller consumes the current one. Reads queued on a pipe or a socket
+ * could complete out of order, hence these get only one read in flight.
+ * Reaching end of file is final, a file that grows is not read further.
+ */
+struct rio_ring {
+  int fd;                     /* io_uring instance */
+  int depth;                  /* number of buffers */
+  int queue;                  /* max number of reads in flight */
+  unsigned head, tail;        /* buffers [head, tail) have been submitted */
+  bool busy;                  /* caller is consuming buffer at head */
+  bool stop;                  /* no more reads after EOF or error */
+  off_t offset;               /* offset of next read, or -1 if not seekable */
+  char *buf;                  /* depth buffers of RIO_BUFSIZE bytes */
+  int *res;                   /* result of read into each buffer */
+  bool *done;                 /* has read into buffer completed? */
+  /* Shared with the kernel. */
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+};
+
+#define RING_CANCEL ((uint64_t)-1) /* user_data of cancel requests */
+
+static int ring_enter(struct rio_ring *r, unsigned submit, unsigned wait) {
+  return syscall(__NR_io_uring_enter, r->fd, submit, wait,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static void ring_push(struct rio_ring *r, int op, uint64_t addr, unsigned len,
+                      uint64_t off, uint64_t data, int fd) {
+  unsigned tail = *r->sq_tail, i = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[i];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = addr;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = data;
+  r->sq_array[i] = i;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Take results of completed reads. */
+static void ring_reap(struct rio_ring *r) {
+  unsigned head = *r->cq_head;
+
+  while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    if (cqe->user_data != RING_CANCEL) {
+      r->res[cqe->user_data] = cqe->res;
+      r->done[cqe->user_data] = true;
+    }
+    head++;
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void ring_free(struct rio_ring *r) {
+  if (r->sqes)
+    munmap(r->sqes, r->sqes_len);
+  if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+    munmap(r->cq_ptr, r->cq_len);
+  if (r->sq_ptr)
+    munmap(r->sq_ptr, r->sq_len);
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r->buf);
+  free(r->res);
+  free(r->done);
+  free(r);
+}
+
+static struct rio_ring *ring_new(int fd, int depth) {
+  struct io_uring_params p;
+  struct rio_ring *r = calloc(1, sizeof(struct rio_ring));
+
+  if (r == NULL)
+    return NULL;
+  memset(&p, 0, sizeof(p));
+  if ((r->fd = syscall(__NR_io_uring_setup, depth * 2, &p)) < 0)
+    goto fail;
+  /* Keep the ring off descriptors below `fd`, which the program may have
+   * reserved, e.g. the shell leaves them to redirections. */
+  if (r->fd < fd) {
+    int high = fcntl(r->fd, F_DUPFD_CLOEXEC, fd);
+    close(r->fd);
+    if ((r->fd = high) < 0)
+      goto fail;
+  }
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->sq_len = r->cq_len = max(r->sq_len, r->cq_len);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    r->sq_ptr = NULL;
+    goto fail;
+  }
+  r->cq_ptr = r->sq_ptr;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) {
+      r->cq_ptr = NULL;
+      goto fail;
+    }
+  }
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    goto fail;
+  }
+
+  char *sq = r->sq_ptr, *cq = r->cq_ptr;
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  r->depth = depth;
+  r->offset = lseek(fd, 0, SEEK_CUR);
+  r->queue = r->offset < 0 ? 1 : depth;
+  r->buf = malloc((size_t)depth * RIO_BUFSIZE);
+  r->res = calloc(depth, sizeof(int));
+  r->done = calloc(depth, sizeof(bool));
+  if (r->buf && r->res && r->done)
+    return r;
+
+fail:
+  ring_free(r);
+  return NULL;
+}
+
+/* Refill from the ring: hand out the next buffer in order, queueing reads
+ * into buffers that the caller is done with. */
+static ssize_t ring_fill(rio_t *rp) {
+  struct rio_ring *r = rp->rio_ring;
+  unsigned submit = 0;
+
+  if (r->busy) {
+    r->head++;
+    r->busy = false;
+  }
+
+  for (; !r->stop && r->tail - r->head < (unsigned)r->queue; r->tail++) {
+    int i = r->tail % r->depth;
+    uint64_t off = r->offset < 0 ? (uint64_t)-1 : (uint64_t)r->offset;
+    r->done[i] = false;
+    ring_push(r, IORING_OP_READ, (uintptr_t)(r->buf + i * RIO_BUFSIZE),
+              RIO_BUFSIZE, off, i, rp->rio_fd);
+    if (r->offset >= 0)
+      r->offset += RIO_BUFSIZE;
+    submit++;
+  }
+
+  if (r->head == r->tail)
+    return 0;
+
+  int i = r->head % r->depth;
+  for (;;) {
+    ring_reap(r);
+    if (r->done[i])
+      break;
+    if (ring_enter(r, submit, 1) < 0) {
+      if (errno == EINTR)
+        return -1; /* submitted reads stay queued */
+      r->stop = true;
+      return -1;
+    }
+    submit = 0;
+  }
+  if (submit > 0)
+    (void)ring_enter(r, submit, 0);
+
+  ssize_t n = r->res[i];
+  if (n < 0) {
+    errno = -n;
+    n = -1;
+  }
+  /* A short read on a file means EOF, reads queued behind it are void.
+   * Pipes, sockets and terminals return whatever is there, for them only
+   * zero means EOF. */
+  if (n <= 0 || (n < RIO_BUFSIZE && r->offset >= 0))
+    r->stop = true;
+  if (n > 0) {
+    r->busy = true;
+    rp->rio_bufptr = r->buf + i * RIO_BUFSIZE;
+  } else {
+    r->head = r->tail;
+  }
+  return n;
+}
+
+/* Cancel reads in flight and wait for them, as the kernel may still be
+ * writing into the buffers. */
+static void ring_close(struct rio_ring *r) {
+  unsigned submit = 0;
+
+  ring_reap(r);
+  for (unsigned t = r->head; t != r->tail; t++) {
+    if (r->done[t % r->depth])
+      continue;
+    ring_push(r, IORING_OP_ASYNC_CANCEL, t % r->depth, 0, 0, RING_CANCEL, -1);
+    submit++;
+  }
+
+  for (unsigned t = r->head; t != r->tail; t++) {
+    while (!r->done[t % r->depth]) {
+      if (ring_enter(r, submit, 1) < 0 && errno != EINTR)
+        break;
+      submit = 0;
+      ring_reap(r);
+    }
+  }
+
+  ring_free(r);
+}
+#endif /* LINUX */
+
+/*
+ * Regular file read through a window mapped into memory, so data is served
+ * straight from page cache instead of being copied into rio_buf. Window moves
+ * forward once the caller has consumed it. File size is checked again at the
+ * end of each window, so appended data gets read too. Truncating the file
+ * while it's being read raises SIGBUS, as with any mapping. If a window
+ * can't be mapped, the file offset is moved past the data already consumed
+ * and reading continues with read().
+ */
+#define RIO_MAPWINDOW (64 << 20)
+
+struct rio_map {
+  char *addr; /* current window or NULL */
+  size_t len; /* length of current window */
+  off_t pos;  /* file offset of first byte past the window */
+};
+
+static ssize_t map_fill(rio_t *rp) {
+  struct rio_map *m = rp->rio_map;
+  struct stat sb;
+
+  if (m->addr) {
+    Munmap(m->addr, m->len);
+    m->addr = NULL;
+  }
+  if (fstat(rp->rio_fd, &sb) < 0)
+    return -1;
+  if (sb.st_size <= m->pos)
+    return 0;
+
+  /* Mapping must start at page boundary. */
+  off_t off = m->pos & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+  size_t skip = m->pos - off;
+  m->len = min(sb.st_size - off, (off_t)RIO_MAPWINDOW);
+  m->addr = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, rp->rio_fd, off);
+  if (m->addr == MAP_FAILED) {
+    if (lseek(rp->rio_fd, m->pos, SEEK_SET) < 0)
+      return -1;
+    free(m);
+    rp->rio_map = NULL;
+    return -1;
+  }
+  (void)madvise(m->addr, m->len, MADV_SEQUENTIAL); /* only a hint */
+  m->pos = off + m->len;
+  rp->rio_bufptr = m->addr + skip;
+  return m->len - skip;
+}
+
+/*
+ * Adaptive buffer is doubled after RIO_ADAPTREADS reads in a row filled it
+ * completely, and halved after as many reads in a row used at most a quarter
+ * of it. Buffer is always empty when it's refilled, so it's simply replaced.
+ */
+#define RIO_ADAPTREADS 4
+
+static void rio_adapt(rio_t *rp) {
+  size_t size = rp->rio_bufsize;
+
+  if (rp->rio_streak >= RIO_ADAPTREADS && size < RIO_MAXBUFSIZE)
+    size *= 2;
+  else if (rp->rio_streak <= -RIO_ADAPTREADS && size > RIO_MINBUFSIZE)
+    size /= 2;
+  else
+    return;
+
+  free(rp->rio_buf);
+  rp->rio_buf = NULL;
+  rp->rio_bufsize = size;
+  rp->rio_streak = 0;
+}
+
+/* rio_fill - Refill internal buffer, return number of bytes, 0 on EOF. */
+static ssize_t rio_fill(rio_t *rp) {
+  ssize_t n;
+
+  /* With mapping given up, the read() path below takes over. */
+  if (rp->rio_map && ((n = map_fill(rp)) >= 0 || rp->rio_map))
+    return n;
+#ifdef LINUX
+  if (rp->rio_ring)
+    return ring_fill(rp);
+#endif
+  if (rp->rio_adaptive)
+    rio_adapt(rp);
+  /* Buffer is allocated on first use and again after rio_idleb. */
+  if (rp->rio_buf == NULL && (rp->rio_buf = malloc(rp->rio_bufsize)) == NULL)
+    return -1;
+
+  n = read(rp->rio_fd, rp->rio_buf, rp->rio_bufsize);
+  if (n > 0) {
+    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+    if ((size_t)n == rp->rio_bufsize)
+      rp->rio_streak = max(rp->rio_streak, 0) + 1;
+    else if ((size_t)n <= rp->rio_bufsize / 4)
+      rp->rio_streak = min(rp->rio_streak, 0) - 1;
+    else
+      rp->rio_streak = 0;
+  }
+  return n;
+}
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -64,19 +406,17 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
   int cnt;
 
   while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
-    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+    rp->rio_cnt = rio_fill(rp);
     if (rp->rio_cnt < 0) {
       if (errno != EINTR) /* Interrupted by sig handler return */
         return -1;
     } else if (rp->rio_cnt == 0) /* EOF */
       return 0;
-    else
-      rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
   }
 
   /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
   cnt = n;
-  if (rp->rio_cnt < n)
+  if ((size_t)rp->rio_cnt < n)
     cnt = rp->rio_cnt;
   memcpy(usrbuf, rp->rio_bufptr, cnt);
   rp->rio_bufptr += cnt;
@@ -93,9 +433,90 @@ ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
 
 /* rio_readinitb - Associate a descriptor with a read buffer and reset buffer */
 void rio_readinitb(rio_t *rp, int fd) {
+  rio_readinitb_size(rp, fd, RIO_BUFSIZE);
+}
+
+/*
+ * rio_readinitb_size - Like rio_readinitb, but with buffer of `size` bytes.
+ *    With size of 0 (RIO_ADAPTIVE) the buffer starts at RIO_BUFSIZE and
+ *    adapts to the stream between RIO_MINBUFSIZE and RIO_MAXBUFSIZE.
+ *    Buffer is allocated on the first read and freed by rio_closeb.
+ */
+void rio_readinitb_size(rio_t *rp, int fd, size_t size) {
   rp->rio_fd = fd;
   rp->rio_cnt = 0;
-  rp->rio_bufptr = rp->rio_buf;
+  rp->rio_buf = NULL;
+  rp->rio_bufptr = NULL;
+  rp->rio_bufsize = size ? size : RIO_BUFSIZE;
+  rp->rio_adaptive = size == RIO_ADAPTIVE;
+  rp->rio_streak = 0;
+  rp->rio_ring = NULL;
+  rp->rio_map = NULL;
+}
+
+/*
+ * rio_idleb - Free the buffer of an idle reader, e.g. a connection that
+ *    has no input pending. Buffer is allocated again on the next read.
+ *    Does nothing if there's unread data in the buffer.
+ */
+void rio_idleb(rio_t *rp) {
+  if (rp->rio_cnt > 0)
+    return;
+  free(rp->rio_buf);
+  rp->rio_buf = NULL;
+}
+
+/*
+ * rio_readinitb_map - Like rio_readinitb, but a regular file is read through
+ *    memory mapping starting at its current offset, which is not advanced.
+ *    Other descriptors, and files that report no size like those in /proc
+ *    and /sys, are read with read(). The reader must be released with
+ *    rio_closeb.
+ */
+void rio_readinitb_map(rio_t *rp, int fd) {
+  struct stat sb;
+  off_t pos;
+
+  rio_readinitb(rp, fd);
+  if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+    return;
+  if ((pos = lseek(fd, 0, SEEK_CUR)) < 0)
+    return;
+  rp->rio_map = Malloc(sizeof(struct rio_map));
+  rp->rio_map->addr = NULL;
+  rp->rio_map->len = 0;
+  rp->rio_map->pos = pos;
+}
+
+/*
+ * rio_readinitb_ring - Like rio_readinitb, but keep up to `depth` reads
+ *    queued ahead in io_uring. Falls back to plain read() when io_uring is
+ *    not available. The reader must be released with rio_closeb.
+ */
+void rio_readinitb_ring(rio_t *rp, int fd, int depth) {
+  rio_readinitb(rp, fd);
+#ifdef LINUX
+  if (depth > 0)
+    rp->rio_ring = ring_new(fd, depth);
+#endif
+}
+
+/* rio_closeb - Release resources of a reader, the descriptor stays open */
+void rio_closeb(rio_t *rp) {
+#ifdef LINUX
+  if (rp->rio_ring)
+    ring_close(rp->rio_ring);
+#endif
+  if (rp->rio_map) {
+    if (rp->rio_map->addr)
+      Munmap(rp->rio_map->addr, rp->rio_map->len);
+    free(rp->rio_map);
+  }
+  free(rp->rio_buf);
+  rp->rio_buf = NULL;
+  rp->rio_ring = NULL;
+  rp->rio_map = NULL;
+  rp->rio_cnt = 0;
 }
 
 /* rio_readnb - Robustly read n bytes (buffered) */
@@ -115,28 +536,129 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
   return (n - nleft); /* return >= 0 */
 }
 
-/* rio_readlineb - Robustly read a text line (buffered) */
+/*
+ * rio_readlineb - Robustly read a text line (buffered). Internal buffer is
+ *    scanned with memchr() and runs of the line are copied out at once.
+ */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-  int n, rc;
-  char c, *bufp = usrbuf;
-
-  for (n = 1; n < maxlen; n++) {
-    if ((rc = rio_read(rp, &c, 1)) == 1) {
-      *bufp++ = c;
-      if (c == '\n') {
-        n++;
-        break;
+  char *bufp = usrbuf;
+  size_t n = 0;
+
+  while (n + 1 < maxlen) {
+    if (rp->rio_cnt <= 0) { /* Refill if buf is empty */
+      rp->rio_cnt = rio_fill(rp);
+      if (rp->rio_cnt < 0) {
+        if (errno != EINTR) /* Interrupted by sig handler return */
+          return -1;
+        continue;
       }
-    } else if (rc == 0) {
-      if (n == 1)
-        return 0; /* EOF, no data read */
-      else
-        break; /* EOF, some data was read */
-    } else
-      return -1; /* Error */
+      if (rp->rio_cnt == 0)
+        break; /* EOF */
+    }
+
+    size_t cnt = min((size_t)rp->rio_cnt, maxlen - 1 - n);
+    char *eol = memchr(rp->rio_bufptr, '\n', cnt);
+    if (eol)
+      cnt = eol - rp->rio_bufptr + 1;
+
+    memcpy(bufp + n, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    n += cnt;
+
+    if (eol)
+      break;
+  }
+  if (maxlen > 0)
+    bufp[n] = 0;
+  return n;
+}
+
+/*
+ * rio_fetchlineb - Read a text line without copying it. On return *linep
+ *    points into the internal buffer and stays valid until the next call on
+ *    `rp`. A line that crosses a refill is returned in pieces, so a piece
+ *    that doesn't end with newline is followed by the rest of its line
+ *    (unless it's the last one before EOF). Returns 0 on EOF.
+ */
+ssize_t rio_fetchlineb(rio_t *rp, char **linep) {
+  while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
+    rp->rio_cnt = rio_fill(rp);
+    if (rp->rio_cnt < 0) {
+      if (errno != EINTR) /* Interrupted by sig handler return */
+        return -1;
+    } else if (rp->rio_cnt == 0) /* EOF */
+      return 0;
   }
-  *bufp = 0;
-  return n - 1;
+
+  char *eol = memchr(rp->rio_bufptr, '\n', rp->rio_cnt);
+  size_t cnt = eol ? eol - rp->rio_bufptr + 1 : rp->rio_cnt;
+
+  *linep = rp->rio_bufptr;
+  rp->rio_bufptr += cnt;
+  rp->rio_cnt -= cnt;
+  return cnt;
+}
+
+/*
+ * rio_getlineb - Read a text line of any length (buffered). As with
+ *    getline(3) the line is stored in *linep, which is grown with realloc()
+ *    as needed, and *np holds the size of that buffer. Each byte is copied
+ *    out of the internal buffer exactly once. Unlike other rio functions an
+ *    interrupted read() is reported back (errno == EINTR) and the partially
+ *    read line is dropped, so interactive programs can abandon it.
+ */
+ssize_t rio_getlineb(rio_t *rp, char **linep, size_t *np) {
+  size_t len = 0;
+
+  for (;;) {
+    if (rp->rio_cnt <= 0) { /* Refill if buf is empty */
+      rp->rio_cnt = rio_fill(rp);
+      if (rp->rio_cnt < 0)
+        return -1; /* errno set by read() */
+      if (rp->rio_cnt == 0)
+        break; /* EOF */
+    }
+
+    char *eol = memchr(rp->rio_bufptr, '\n', rp->rio_cnt);
+    size_t cnt = eol ? eol - rp->rio_bufptr + 1 : rp->rio_cnt;
+
+    /* Make sure there's enough space for the run and terminating NUL. */
+    if (len + cnt + 1 > *np) {
+      size_t size = max(*np * 2, len + cnt + 1);
+      char *line = realloc(*linep, size);
+      if (line == NULL)
+        return -1;
+      *linep = line;
+      *np = size;
+    }
+
+    memcpy(*linep + len, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    len += cnt;
+
+    if (eol)
+      break;
+  }
+
+  if (len > 0)
+    (*linep)[len] = 0;
+  return len;
+}
+
+ssize_t Rio_getlineb(rio_t *rp, char **linep, size_t *np) {
+  ssize_t rc = rio_getlineb(rp, linep, np);
+  if (rc < 0)
+    unix_error("Rio_getlineb error");
+  return rc;
+}
+
+ssize_t Rio_fetchlineb(rio_t *rp, char **linep) {
+  ssize_t rc = rio_fetchlineb(rp, linep);
+  if (rc < 0)
+    unix_error("Rio_fetchlineb error");
+  return rc;
 }
 
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
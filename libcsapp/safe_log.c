@@ -0,0 +1,73 @@
+#include <stdarg.h>
+#include "csapp.h"
+
+/* Signal handlers can't write out messages without risking to block or to
+ * interleave them with output of the interrupted program. Instead they
+ * append messages to a ring of fixed-size slots, which the program drains
+ * in batches with a single writev(2). Appending takes no locks and makes no
+ * system calls, so it's safe in handlers, nested ones included. A slot is
+ * taken by bumping `tail`, and becomes visible to the reader once its `seq`
+ * is set, so a message interrupted half-way holds back the ones after it
+ * until it's complete. Long messages are cut short. If the ring is full,
+ * the message is dropped and counted. There must be only one reader. */
+
+#define LOGSLOTS 64
+#define LOGSLOTSZ 256
+
+typedef struct {
+  unsigned seq; /* number of message in the slot plus one, when complete */
+  int len;
+  char buf[LOGSLOTSZ];
+} logslot_t;
+
+static logslot_t slot[LOGSLOTS];
+static unsigned head, tail; /* messages [head, tail) are in the ring */
+static unsigned lost;       /* messages dropped since last drain */
+
+void safe_log(const char *fmt, ...) {
+  unsigned t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+  va_list ap;
+
+  do {
+    if (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) >= LOGSLOTS) {
+      __atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&tail, &t, t + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  logslot_t *s = &slot[t % LOGSLOTS];
+  va_start(ap, fmt);
+  s->len = safe_vsnprintf(s->buf, sizeof(s->buf), fmt, ap);
+  va_end(ap);
+  __atomic_store_n(&s->seq, t + 1, __ATOMIC_RELEASE);
+}
+
+/* Write out complete messages from the ring. Not to be called by handlers. */
+void safe_log_flush(int fd) {
+  struct iovec iov[LOGSLOTS + 1];
+  char note[64];
+  unsigned t = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  int n = 0;
+
+  for (; n < LOGSLOTS; n++, t++) {
+    logslot_t *s = &slot[t % LOGSLOTS];
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != t + 1)
+      break;
+    iov[n].iov_base = s->buf;
+    iov[n].iov_len = s->len;
+  }
+
+  unsigned nlost = __atomic_exchange_n(&lost, 0, __ATOMIC_RELAXED);
+  if (nlost > 0) {
+    iov[n].iov_base = note;
+    iov[n++].iov_len =
+      safe_snprintf(note, sizeof(note), "safe_log: %u messages lost\n", nlost);
+  }
+
+  if (n == 0)
+    return;
+  while (writev(fd, iov, n) < 0 && errno == EINTR)
+    continue;
+  __atomic_store_n(&head, t, __ATOMIC_RELEASE);
+}
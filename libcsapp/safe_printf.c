@@ -7,47 +7,64 @@ static char const digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
 #define MAXNBUF (sizeof(intmax_t) * 8 + 1)
 #define LINELEN 512
 
+/* Digits are stored at the end of `nbuf`, returns the first one. */
 static char *print_num(char *nbuf, uintmax_t num, int base, int *len_p) {
-  char *p = nbuf;
+  char *p = nbuf + MAXNBUF;
 
-  *p = '\0';
   do {
-    *++p = digits[num % base];
+    *--p = digits[num % base];
   } while (num /= base);
 
-  *len_p = p - nbuf;
+  *len_p = nbuf + MAXNBUF - p;
   return p;
 }
 
-static int safe_vprintf(int fd, const char *fmt, va_list ap) {
-  char line[LINELEN];
+/*
+ * safe_vsnprintf - Signal safe subset of vsnprintf(3). Understands %c, %s,
+ *    %d, %i, %u, %x, %p and %%, with '-', '0' or '#' flag, field width and 'l',
+ *    'll' or 'z' size modifier. Hexadecimal numbers always get 0x prefix.
+ *    Output is cut to fit `size` bytes including NUL. Returns the number of
+ *    characters stored in `buf`.
+ */
+int safe_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap) {
   char nbuf[MAXNBUF];
-  int linelen = 0;
+  size_t len = 0;
   int stop = 0;
 
 #define PCHAR(c)                                                               \
   {                                                                            \
     int _c = (c);                                                              \
-    if (linelen < MAXLINE)                                                     \
-      line[linelen++] = _c;                                                    \
+    if (len + 1 < size)                                                        \
+      buf[len++] = _c;                                                         \
   }
 
   if (fmt == NULL)
     fmt = "(null)\n";
 
   for (;;) {
-    int neg = 0, lflag = 0;
-    int ch, n, base, sign;
+    int ladjust = 0, zpad = 0, width = 0, lflag = 0;
+    int ch, n, pad, base, sign;
+    const char *prefix = "";
     uintmax_t num;
+    char *p;
 
     while ((ch = *fmt++) != '%' || stop) {
       if (ch == '\0')
-        goto print;
+        goto done;
       PCHAR(ch);
     }
 
     const char *percent = fmt - 1;
-    char *p;
+
+    /* '#' is accepted, but hexadecimal numbers always get their prefix */
+    for (; *fmt == '-' || *fmt == '0' || *fmt == '#'; fmt++) {
+      if (*fmt == '-')
+        ladjust = 1;
+      else if (*fmt == '0')
+        zpad = 1;
+    }
+    for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+      width = width * 10 + *fmt - '0';
 
   again:
     switch ((ch = *fmt++)) {
@@ -56,54 +73,79 @@ static int safe_vprintf(int fd, const char *fmt, va_list ap) {
         break;
 
       case 'l':
-        lflag = 1;
+        lflag++;
+        goto again;
+
+      case 'z':
+        lflag = 2;
         goto again;
 
       case 'c':
-        PCHAR(va_arg(ap, int));
-        break;
+        nbuf[0] = va_arg(ap, int);
+        p = nbuf;
+        n = 1;
+        goto field;
 
       case 's':
         p = va_arg(ap, char *);
         if (p == NULL)
           p = "(null)";
         n = strlen(p);
-        while (n--)
-          PCHAR(*p++);
-        break;
+        goto field;
 
       case 'd':
+      case 'i':
         base = 10;
         sign = 1;
-        if (lflag)
+        if (lflag > 1)
+          num = va_arg(ap, long long);
+        else if (lflag)
           num = va_arg(ap, long);
         else
           num = va_arg(ap, int);
         goto number;
 
+      case 'u':
       case 'x':
-        base = 16;
+        base = ch == 'u' ? 10 : 16;
         sign = 0;
-        if (lflag)
+        if (lflag > 1)
+          num = va_arg(ap, unsigned long long);
+        else if (lflag)
           num = va_arg(ap, unsigned long);
         else
           num = va_arg(ap, unsigned int);
         goto number;
 
+      case 'p':
+        base = 16;
+        sign = 0;
+        num = (uintptr_t)va_arg(ap, void *);
+        goto number;
+
       number:
         if (sign && (intmax_t)num < 0) {
-          neg = 1;
-          num = -(intmax_t)num;
-        }
-        if (neg)
-          PCHAR('-');
-        if (base == 16) {
-          PCHAR('0');
-          PCHAR('x');
+          prefix = "-";
+          num = -num;
         }
+        if (base == 16)
+          prefix = "0x";
         p = print_num(nbuf, num, base, &n);
+
+      field:
+        pad = width - n - strlen(prefix);
+        if (!ladjust && !zpad)
+          for (; pad > 0; pad--)
+            PCHAR(' ');
+        while (*prefix)
+          PCHAR(*prefix++);
+        if (!ladjust)
+          for (; pad > 0; pad--)
+            PCHAR('0');
         while (n--)
-          PCHAR(*p--);
+          PCHAR(*p++);
+        for (; pad > 0; pad--)
+          PCHAR(' ');
         break;
 
       default:
@@ -115,7 +157,23 @@ static int safe_vprintf(int fd, const char *fmt, va_list ap) {
   }
 #undef PCHAR
 
-print:
+done:
+  if (size > 0)
+    buf[len] = '\0';
+  return len;
+}
+
+int safe_snprintf(char *buf, size_t size, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = safe_vsnprintf(buf, size, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+static int safe_vprintf(int fd, const char *fmt, va_list ap) {
+  char line[LINELEN];
+  int linelen = safe_vsnprintf(line, sizeof(line), fmt, ap);
   return write(fd, line, linelen);
 }
 
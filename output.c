@@ -0,0 +1,82 @@
+#include <stdarg.h>
+
+#include "shell.h"
+
+/* Reports made of many lines, like the job table or flow through pipes, are
+ * collected in chunks and written out with a single writev(2), instead of
+ * a write per line. The buffer is flushed before the shell forks, so that
+ * a child never inherits pending output. Error messages go through `msg`,
+ * which isn't buffered. Messages logged by signal handlers with `safe_log`
+ * are written out first. */
+
+#define CHUNKSZ 4096
+#define MAXCHUNKS 64
+
+static char *chunk[MAXCHUNKS];
+static struct iovec iov[MAXCHUNKS];
+static size_t size[MAXCHUNKS]; /* capacity of each chunk */
+static int nchunks = 0;
+
+void bflush(void) {
+  struct iovec *v = iov;
+  int n = nchunks;
+
+  safe_log_flush(STDERR_FILENO);
+
+  while (n > 0) {
+    ssize_t w = writev(STDERR_FILENO, v, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    /* skip what was written, including a part of a chunk */
+    for (; n > 0 && (size_t)w >= v->iov_len; v++, n--)
+      w -= v->iov_len;
+    if (n > 0) {
+      v->iov_base = (char *)v->iov_base + w;
+      v->iov_len -= w;
+    }
+  }
+
+  for (int i = 0; i < nchunks; i++)
+    free(chunk[i]);
+  nchunks = 0;
+}
+
+void bmsg(const char *fmt, ...) {
+  va_list ap;
+  int len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    return;
+
+  struct iovec *v = nchunks > 0 ? &iov[nchunks - 1] : NULL;
+  if (v == NULL || v->iov_len + len >= size[nchunks - 1]) {
+    if (nchunks == MAXCHUNKS)
+      bflush();
+    size_t sz = max(CHUNKSZ, len + 1);
+    char *buf = malloc(sz);
+    if (buf == NULL) {
+      /* write it out directly, keeping the order of messages */
+      bflush();
+      va_start(ap, fmt);
+      vdprintf(STDERR_FILENO, fmt, ap);
+      va_end(ap);
+      return;
+    }
+    chunk[nchunks] = buf;
+    size[nchunks] = sz;
+    v = &iov[nchunks++];
+    v->iov_base = buf;
+    v->iov_len = 0;
+  }
+
+  va_start(ap, fmt);
+  vsnprintf((char *)v->iov_base + v->iov_len, len + 1, fmt, ap);
+  va_end(ap);
+  v->iov_len += len;
+}
@@ -0,0 +1,150 @@
+#include <sys/ioctl.h>
+
+#include "shell.h"
+
+/* Pipe buffers are 64KiB by default. Stages that move a lot of data switch
+ * context on every buffer, so pipe size can be set for all pipelines with
+ * PIPESIZE variable, or for a single pipe with `|{SIZE}` operator. With
+ * PIPESIZE=auto pipes of a foreground pipeline start with default size and
+ * grow while they are found full whenever they're sampled. */
+
+#define SAMPLE_USEC 10000 /* sampling period of watched pipes */
+#define FULL_SAMPLES 4    /* grow a pipe if it was full that many times */
+
+typedef struct {
+  char path[32];  /* /proc/<pid>/fd/0 of the reader */
+  ino_t ino;      /* identifies the pipe, reader's stdin may change */
+  int size;       /* current pipe capacity */
+  int full;       /* how many recent samples found the pipe full */
+} watch_t;
+
+static watch_t *watched = NULL;
+static int nwatched = 0;
+static int maxsize = 0; /* max pipe size for unprivileged user */
+
+/* Parse size like 65536, 256K or 1M. Returns -1 if it's not valid. */
+long pipesize(const char *s) {
+  char *end;
+  long size = strtol(s, &end, 10);
+
+  if (end == s || size <= 0 || size > INT_MAX)
+    return -1;
+
+  const char *units = "kKmMgG", *unit = *end ? strchr(units, *end) : NULL;
+  if (unit) {
+    size <<= 10 * ((unit - units) / 2 + 1);
+    end++;
+  }
+  return *end == '\0' && size <= INT_MAX ? size : -1;
+}
+
+/* Kernel rounds the size up to a power of two number of pages and refuses
+ * to go beyond /proc/sys/fs/pipe-max-size, then the pipe is left as it is. */
+void setpipesize(int fd, long size) {
+#ifdef F_SETPIPE_SZ
+  if (size > 0)
+    (void)fcntl(fd, F_SETPIPE_SZ, (int)size);
+#endif
+}
+
+/* Remember pipe `fd` read by process `reader` on its standard input, so it
+ * can be sampled after the shell closes its own descriptors. */
+void watchpipe(pid_t reader, int fd) {
+#ifdef F_GETPIPE_SZ
+  struct stat sb;
+
+  if (fstat(fd, &sb) < 0 || !S_ISFIFO(sb.st_mode))
+    return;
+
+  watched = Realloc(watched, sizeof(watch_t) * (nwatched + 1));
+  watch_t *w = &watched[nwatched++];
+  snprintf(w->path, sizeof(w->path), "/proc/%d/fd/0", (int)reader);
+  w->ino = sb.st_ino;
+  w->size = fcntl(fd, F_GETPIPE_SZ);
+  w->full = 0;
+#endif
+}
+
+/* Runs on SIGALRM, i.e. only while the shell waits for foreground job.
+ * Pipe is reached through reader's descriptor table, as the shell doesn't
+ * keep any of pipe ends open. Otherwise the reader would never get EOF or
+ * the writer would never get EPIPE. */
+static void sample_handler(int sig) {
+  int old_errno = errno;
+  (void)sig;
+
+#if defined(F_SETPIPE_SZ) && defined(FIONREAD)
+  for (int i = 0; i < nwatched; i++) {
+    watch_t *w = &watched[i];
+    struct stat sb;
+    int fd, nbytes;
+
+    if (w->size >= maxsize)
+      continue;
+    if ((fd = open(w->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+      continue;
+
+    if (fstat(fd, &sb) == 0 && sb.st_ino == w->ino &&
+        ioctl(fd, FIONREAD, &nbytes) == 0) {
+      if (nbytes >= w->size)
+        w->full++;
+      else if (w->full > 0)
+        w->full--;
+
+      if (w->full >= FULL_SAMPLES) {
+        int size = fcntl(fd, F_SETPIPE_SZ, min(w->size * 2, maxsize));
+        w->size = size > 0 ? size : maxsize;
+        w->full = 0;
+      }
+    }
+
+    close(fd);
+  }
+#endif
+
+  errno = old_errno;
+}
+
+static int readmaxsize(void) {
+  int size = 1 << 20;
+  FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+  if (f) {
+    if (fscanf(f, "%d", &size) != 1)
+      size = 1 << 20;
+    fclose(f);
+  }
+  return size;
+}
+
+/* Start sampling watched pipes, or stop it and forget them. */
+void growpipes(bool start) {
+  struct itimerval itv = {
+    .it_interval = {.tv_usec = SAMPLE_USEC},
+    .it_value = {.tv_usec = SAMPLE_USEC},
+  };
+
+  if (start) {
+    if (nwatched == 0)
+      return;
+
+    /* Handler stays installed, so a late SIGALRM can't kill the shell. */
+    if (maxsize == 0) {
+      struct sigaction act = {
+        .sa_handler = sample_handler,
+        .sa_flags = SA_RESTART,
+      };
+      sigemptyset(&act.sa_mask);
+      Sigaction(SIGALRM, &act, NULL);
+      maxsize = readmaxsize();
+    }
+    setitimer(ITIMER_REAL, &itv, NULL);
+  } else {
+    if (nwatched > 0) {
+      memset(&itv, 0, sizeof(itv));
+      setitimer(ITIMER_REAL, &itv, NULL);
+    }
+    free(watched);
+    watched = NULL;
+    nwatched = 0;
+  }
+}
@@ -0,0 +1,125 @@
+#include "shell.h"
+#include "rio.h"
+
+/* With PIPESTAT set, each pair of pipeline stages is connected through
+ * a relay process that moves data between two pipes and measures the flow:
+ *
+ *   stage | relay | stage | relay | stage
+ *
+ * Relays belong to the job, but they are not shown in its command. Counters
+ * live in memory shared with the shell, so they can be reported while the
+ * job is running (`jobs -v`) and when it finishes. Time spent by the relay
+ * waiting for input means upstream stage is the bottleneck, time spent
+ * waiting for room in the output pipe means downstream stage is. */
+
+#define RELAYCHUNK (1 << 20)
+
+typedef struct {
+  uint64_t bytes;    /* bytes moved so far */
+  uint64_t rwait;    /* nanoseconds spent waiting for input */
+  uint64_t wwait;    /* nanoseconds spent waiting for room in output pipe */
+  uint64_t start;    /* when the relay started */
+  uint64_t end;      /* when it got EOF or the reader went away, or 0 */
+} edge_t;
+
+struct pipestat {
+  int nedges;
+  edge_t *edge;  /* shared with relay processes */
+  char **cmd;    /* command of each stage */
+};
+
+static uint64_t nsec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+pipestat_t *pipestat_new(int nstages) {
+  pipestat_t *ps = Malloc(sizeof(pipestat_t));
+  ps->nedges = nstages - 1;
+  ps->edge = Mmap(NULL, sizeof(edge_t) * ps->nedges, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  ps->cmd = Calloc(nstages, sizeof(char *));
+  return ps;
+}
+
+void pipestat_free(pipestat_t *ps) {
+  for (int i = 0; i <= ps->nedges; i++)
+    free(ps->cmd[i]);
+  free(ps->cmd);
+  Munmap(ps->edge, sizeof(edge_t) * ps->nedges);
+  free(ps);
+}
+
+void pipestat_setcmd(pipestat_t *ps, int stage, char **argv) {
+  for (; *argv; argv++) {
+    if (ps->cmd[stage])
+      strapp(&ps->cmd[stage], " ");
+    strapp(&ps->cmd[stage], *argv);
+  }
+}
+
+/* Move data from `in` to `out` until EOF or until the reader goes away. */
+noreturn void pipestat_relay(pipestat_t *ps, int e, int in, int out) {
+  edge_t *edge = &ps->edge[e];
+  struct pollfd pin = {.fd = in, .events = POLLIN};
+  struct pollfd pout = {.fd = out, .events = POLLOUT};
+
+  Signal(SIGPIPE, SIG_IGN);
+  edge->start = nsec();
+
+  for (;;) {
+    uint64_t t = nsec();
+    if (poll(&pin, 1, -1) < 0 && errno != EINTR)
+      break;
+    edge->rwait += nsec() - t;
+
+#ifdef LINUX
+    /* Input is ready, so it's the output that isn't if we get EAGAIN. */
+    ssize_t n = splice(in, NULL, out, NULL, RELAYCHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && errno == EAGAIN) {
+      t = nsec();
+      if (poll(&pout, 1, -1) < 0 && errno != EINTR)
+        break;
+      edge->wwait += nsec() - t;
+      continue;
+    }
+#else
+    static char buf[RELAYCHUNK];
+    ssize_t n = read(in, buf, sizeof(buf));
+    if (n > 0) {
+      t = nsec();
+      (void)pout;
+      if (rio_writen(out, buf, n) < 0)
+        break;
+      edge->wwait += nsec() - t;
+    }
+#endif
+    if (n <= 0)
+      break;
+    edge->bytes += n;
+  }
+
+  edge->end = nsec();
+  _exit(0);
+}
+
+/* Report flow through each pipe of job `j`. */
+void pipestat_print(int j, pipestat_t *ps) {
+  for (int e = 0; e < ps->nedges; e++) {
+    edge_t *edge = &ps->edge[e];
+    if (edge->start == 0)
+      continue;
+
+    uint64_t end = edge->end ? edge->end : nsec();
+    double secs = (end - edge->start) / 1e9;
+    double mbps = secs > 0 ? edge->bytes / secs / 1e6 : 0;
+    const char *slow = edge->rwait > edge->wwait ? ps->cmd[e] : ps->cmd[e + 1];
+
+    bmsg("[%d] '%s' -> '%s': %llu bytes, %.1f MB/s, waited %.2fs for input, "
+         "%.2fs for output, slower side '%s'\n",
+         j, ps->cmd[e], ps->cmd[e + 1], (unsigned long long)edge->bytes, mbps,
+         edge->rwait / 1e9, edge->wwait / 1e9, slow ? slow : "?");
+  }
+}
@@ -0,0 +1,264 @@
+#include "shell.h"
+#include "rio.h"
+
+/* Scripts are compiled into a position independent image that is cached on
+ * disk and mapped into memory when the same script is run again:
+ *
+ *   header | script path | commands | strings
+ *
+ * Each command (compound commands span several lines of the script) is
+ * a token count followed by that many tokens, all 32-bit.
+ * Tokens below STRTOK are operators (T_PIPE, T_INPUT, ...), the others are
+ * offsets (biased by STRTOK) of NUL-terminated words in strings section.
+ * The cache entry is valid as long as script's size and mtime don't change. */
+
+#define MAGIC "shcache3"
+#define STRTOK 256
+
+typedef struct {
+  char magic[8];
+  int64_t mtime_sec;  /* script modification time */
+  int64_t mtime_nsec;
+  uint64_t size;      /* script size */
+  uint32_t pathlen;   /* length of script path including NUL and padding */
+  uint32_t ncmds;     /* number of commands */
+  uint64_t cmdsize;   /* size of commands section in bytes */
+  uint64_t strsize;   /* size of strings section in bytes */
+} header_t;
+
+struct script {
+  char *path;       /* absolute path of the script */
+  char *cache;      /* path of cache file or NULL if cache is unavailable */
+  struct stat sb;   /* script file status when it was opened */
+  void *image;      /* compiled script, mapped from cache file or malloc'ed */
+  size_t size;      /* size of the image */
+  bool mapped;      /* was the image mapped from cache file? */
+  uint32_t *cmd;    /* next command to be run */
+  uint32_t *end;    /* end of commands section */
+  char *strings;    /* strings section */
+  uint64_t strsize; /* size of strings section */
+  /* Used while the script is being compiled. */
+  uint32_t *cmds;   /* commands section under construction */
+  size_t ncmdw, cmdcap;
+  char *strs;       /* strings section under construction */
+  size_t strused, strcap;
+  uint32_t ncmds;
+};
+
+/* Cache files live in $XDG_CACHE_HOME/shell or ~/.cache/shell,
+ * and are named after a hash of script's absolute path. */
+static char *cachepath(const char *path) {
+  const char *home = getenv("HOME");
+  const char *base = getenv("XDG_CACHE_HOME");
+  char dir[PATH_MAX], *file;
+
+  if (base && *base)
+    snprintf(dir, sizeof(dir), "%s/shell", base);
+  else if (home && *home)
+    snprintf(dir, sizeof(dir), "%s/.cache/shell", home);
+  else
+    return NULL;
+
+  /* Make sure cache directory and its parent exist. */
+  char *slash = strrchr(dir, '/');
+  *slash = '\0';
+  (void)mkdir(dir, 0700);
+  *slash = '/';
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    return NULL;
+
+  uint32_t hash = jenkins_hash(path, strlen(path), HASHINIT);
+  if (asprintf(&file, "%s/%08x.shc", dir, hash) < 0)
+    return NULL;
+  return file;
+}
+
+static script_t *script_alloc(const char *path) {
+  script_t *sc = calloc(1, sizeof(script_t));
+
+  if ((sc->path = realpath(path, NULL)) == NULL || stat(sc->path, &sc->sb)) {
+    free(sc->path);
+    free(sc);
+    return NULL;
+  }
+
+  sc->cache = cachepath(sc->path);
+  return sc;
+}
+
+static void script_setimage(script_t *sc, void *image, size_t size) {
+  header_t *hdr = image;
+  char *p = (char *)(hdr + 1) + hdr->pathlen;
+
+  sc->image = image;
+  sc->size = size;
+  sc->cmd = (uint32_t *)p;
+  sc->end = (uint32_t *)(p + hdr->cmdsize);
+  sc->strings = p + hdr->cmdsize;
+  sc->strsize = hdr->strsize;
+}
+
+/* Returns cached compiled script if it's up to date, otherwise NULL. */
+script_t *script_open(const char *path) {
+  script_t *sc = script_alloc(path);
+  if (sc == NULL || sc->cache == NULL)
+    goto fail;
+
+  int fd = open(sc->cache, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    goto fail;
+
+  struct stat sb;
+  Fstat(fd, &sb);
+  size_t size = sb.st_size;
+  if (size < sizeof(header_t)) {
+    Close(fd);
+    goto fail;
+  }
+
+  void *image = Mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  Close(fd);
+  sc->mapped = true;
+
+  header_t *hdr = image;
+  size_t pathlen = strlen(sc->path) + 1;
+  if (memcmp(hdr->magic, MAGIC, sizeof(hdr->magic)) ||
+      hdr->mtime_sec != sc->sb.st_mtim.tv_sec ||
+      hdr->mtime_nsec != sc->sb.st_mtim.tv_nsec ||
+      hdr->size != (uint64_t)sc->sb.st_size ||
+      hdr->pathlen < pathlen || hdr->pathlen % sizeof(uint32_t) ||
+      sizeof(header_t) + hdr->pathlen + hdr->cmdsize + hdr->strsize != size ||
+      hdr->cmdsize % sizeof(uint32_t) ||
+      strcmp((char *)(hdr + 1), sc->path) ||
+      (hdr->strsize > 0 && ((char *)image)[size - 1] != '\0')) {
+    Munmap(image, size);
+    goto fail;
+  }
+
+  script_setimage(sc, image, size);
+  return sc;
+
+fail:
+  if (sc) {
+    free(sc->cache);
+    free(sc->path);
+    free(sc);
+  }
+  return NULL;
+}
+
+/* Start compiling a script, commands are then added with `script_add`. */
+script_t *script_new(const char *path) {
+  return script_alloc(path);
+}
+
+static void putcmdw(script_t *sc, uint32_t w) {
+  if (sc->ncmdw == sc->cmdcap) {
+    sc->cmdcap = max(sc->cmdcap * 2, (size_t)1024);
+    sc->cmds = Realloc(sc->cmds, sc->cmdcap * sizeof(uint32_t));
+  }
+  sc->cmds[sc->ncmdw++] = w;
+}
+
+static uint32_t putstr(script_t *sc, const char *str) {
+  size_t n = strlen(str) + 1;
+  uint32_t off = sc->strused;
+
+  if (sc->strused + n > sc->strcap) {
+    sc->strcap = max(sc->strcap * 2, sc->strused + n + 4096);
+    sc->strs = Realloc(sc->strs, sc->strcap);
+  }
+  memcpy(sc->strs + sc->strused, str, n);
+  sc->strused += n;
+  return off + STRTOK;
+}
+
+/* Append a tokenized command line (with here-documents read in). */
+void script_add(script_t *sc, token_t *token, int ntokens) {
+  putcmdw(sc, ntokens);
+  for (int i = 0; i < ntokens; i++)
+    putcmdw(sc, string_p(token[i]) ? putstr(sc, token[i]) : (long)token[i]);
+  sc->ncmds++;
+}
+
+/* Finish compilation so that the script can be run and store it in cache. */
+void script_save(script_t *sc) {
+  size_t pathlen = (strlen(sc->path) + sizeof(uint32_t)) & -sizeof(uint32_t);
+  size_t cmdsize = sc->ncmdw * sizeof(uint32_t);
+  size_t size = sizeof(header_t) + pathlen + cmdsize + sc->strused;
+  header_t *hdr = Calloc(1, size);
+
+  memcpy(hdr->magic, MAGIC, sizeof(hdr->magic));
+  hdr->mtime_sec = sc->sb.st_mtim.tv_sec;
+  hdr->mtime_nsec = sc->sb.st_mtim.tv_nsec;
+  hdr->size = sc->sb.st_size;
+  hdr->pathlen = pathlen;
+  hdr->ncmds = sc->ncmds;
+  hdr->cmdsize = cmdsize;
+  hdr->strsize = sc->strused;
+
+  char *p = (char *)(hdr + 1);
+  strcpy(p, sc->path);
+  p += pathlen;
+  memcpy(p, sc->cmds, cmdsize);
+  p += cmdsize;
+  memcpy(p, sc->strs, sc->strused);
+
+  free(sc->cmds);
+  free(sc->strs);
+  sc->cmds = NULL;
+  sc->strs = NULL;
+  script_setimage(sc, hdr, size);
+
+  if (sc->cache == NULL)
+    return;
+
+  /* Write to a temporary file first, so that concurrently started shells
+   * never see a partially written cache file. */
+  char *tmp;
+  if (asprintf(&tmp, "%s.XXXXXX", sc->cache) < 0)
+    return;
+  int fd = mkstemp(tmp);
+  if (fd >= 0) {
+    if (rio_writen(fd, hdr, size) != (ssize_t)size || rename(tmp, sc->cache))
+      (void)unlink(tmp);
+    Close(fd);
+  }
+  free(tmp);
+}
+
+/* Returns next command of compiled script or NULL if there are none left.
+ * Words point into the image, only returned vector must be freed. */
+token_t *script_next(script_t *sc, int *ntokensp) {
+  if (sc->cmd >= sc->end)
+    return NULL;
+
+  uint32_t ntokens = *sc->cmd++;
+  if (ntokens > (size_t)(sc->end - sc->cmd))
+    app_error("ERROR: Corrupted script cache '%s'!", sc->cache);
+
+  token_t *token = Malloc(sizeof(token_t) * (ntokens + 1));
+  for (uint32_t i = 0; i < ntokens; i++) {
+    uint32_t t = *sc->cmd++;
+    if (t < STRTOK) {
+      token[i] = (token_t)(long)t;
+    } else if (t - STRTOK < sc->strsize) {
+      token[i] = sc->strings + t - STRTOK;
+    } else {
+      app_error("ERROR: Corrupted script cache '%s'!", sc->cache);
+    }
+  }
+  token[ntokens] = NULL;
+  *ntokensp = ntokens;
+  return token;
+}
+
+void script_close(script_t *sc) {
+  if (sc->mapped)
+    Munmap(sc->image, sc->size);
+  else
+    free(sc->image);
+  free(sc->cache);
+  free(sc->path);
+  free(sc);
+}
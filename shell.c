@@ -1,16 +1,22 @@
 #ifdef READLINE
-#include <readline/readline.h>
-#include <readline/history.h>
+#include <dlfcn.h>
 #endif
 
 #define DEBUG 0
 #include "shell.h"
+#include "queue.h"
+#include "rio.h"
 
 sigset_t sigchld_mask;
 
+static bool noexec = false; /* only check command lines, never run them */
+static char *cmdstr = NULL; /* unread part of `-c` command string or NULL */
+volatile sig_atomic_t interrupted; /* SIGINT arrived, stop loops */
+
 static void sigint_handler(int sig) {
-  /* No-op handler, we just need break read() call with EINTR. */
+  /* We just need break read() call with EINTR and loops run by the shell. */
   (void)sig;
+  interrupted = 1;
 }
 
 /* Rewrite closed file descriptors to -1,
@@ -22,64 +28,496 @@ static void MaybeClose(int *fdp) {
   *fdp = -1;
 }
 
-/* Consume all tokens related to redirection operators.
- * Put opened file descriptors into inputp & output respectively. */
-static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp) {
-  token_t mode = NULL; /* T_INPUT, T_OUTPUT or NULL */
-  int n = 0;           /* number of tokens after redirections are removed */
+static void mkpipe(int *readp, int *writep) {
+  int fds[2];
+#ifdef LINUX
+  Pipe2(fds, O_CLOEXEC);
+#else
+  Pipe(fds);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+  *readp = fds[0];
+  *writep = fds[1];
+}
+
+/* Child must not inherit buffered output, it would be written out twice. */
+pid_t spawn(void) {
+  bflush();
+  return Fork();
+}
+
+/* Here-document and here-string bodies are passed to commands through a file
+ * that lives in memory and is sealed against modification. Unlike a pipe it
+ * needs no writer process and cannot block when the body is large. */
+static int herefd(const char *body, bool newline) {
+  struct iovec iov[2] = {
+    {.iov_base = (void *)body, .iov_len = strlen(body)},
+    {.iov_base = "\n", .iov_len = newline},
+  };
+#ifdef LINUX
+  int fd = Memfd_create("here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  Writev(fd, iov, 2);
+  /* sealing is best-effort, the body is in place either way */
+  (void)fcntl(fd, F_ADD_SEALS,
+              F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+#else
+  char path[] = "/tmp/shell-here.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+    unix_error("mkstemp error");
+  Unlink(path);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  Writev(fd, iov, 2);
+#endif
+  Lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+/* Redirections of the command that is about to be started. They're made in
+ * order, after the command is connected to its pipes. Files are opened by
+ * the shell close-on-exec and above descriptors that can be redirected,
+ * so making one redirection never clobbers a file of another one. */
+
+typedef struct {
+  int fd;       /* descriptor being redirected */
+  int src;      /* descriptor that `fd` becomes a copy of, -1 closes `fd` */
+  bool own;     /* `src` was opened by the shell for this command */
+  int saved;    /* copy of original `fd` for builtins, or -1 */
+  bool cloexec; /* was original `fd` close-on-exec? */
+} redir_t;
+
+static redir_t *redirs = NULL;
+static int nredirs = 0;
+
+/* Move descriptor the shell keeps for itself out of user's range. */
+static int highfd(int fd, bool cloexec) {
+  if (fd >= NREDIRFD)
+    return fd;
+  int high = fcntl(fd, cloexec ? F_DUPFD_CLOEXEC : F_DUPFD, NREDIRFD);
+  Close(fd);
+  return high;
+}
+
+static void addredir(int fd, int src, bool own) {
+  if (own)
+    src = highfd(src, true);
+  redirs = Realloc(redirs, sizeof(redir_t) * (nredirs + 1));
+  redirs[nredirs++] = (redir_t){.fd = fd, .src = src, .own = own};
+}
+
+/* Forget redirections once the command is started, closing files the shell
+ * has opened for it. */
+static void closeredirs(void) {
+  for (int i = 0; i < nredirs; i++)
+    if (redirs[i].own)
+      Close(redirs[i].src);
+  free(redirs);
+  redirs = NULL;
+  nredirs = 0;
+}
+
+/* Parses descriptor number in `n>&m` or `n>&-`, which gives -1. */
+static int fdnum(const char *word) {
+  char *end;
+  long fd = strtol(word, &end, 10);
+  if (!strcmp(word, "-"))
+    return -1;
+  if (end == word || *end || fd < 0 || fd > INT_MAX)
+    return -2;
+  return fd;
+}
+
+/* Consume all tokens related to redirection operators. Files are opened, and
+ * redirections are recorded to be made by applyredirs. Returns the number of
+ * remaining tokens, or -1 if a redirection can't be made. Remaining tokens
+ * are valid command in either case, further redirections are skipped. In dry
+ * run (-n) descriptor numbers are checked, but nothing is opened. */
+static int do_redir(token_t *token, int ntokens) {
+  int n = 0;   /* number of tokens after redirections are removed */
+  int fd = -1; /* descriptor given before the operator, e.g. 2 in 2> */
+  bool failed = false;
 
   for (int i = 0; i < ntokens; i++) {
     /* TODO: Handle tokens and open files as requested. */
 #ifdef STUDENT
-    (void)mode;
-    (void)MaybeClose;
+    token_t mode = token[i];
+
+    /* if it isn't a redirection operator, copy and continue */
+    if (!redir_p(mode)) {
+      token[n++] = mode;
+      continue;
+    }
+
+    /* operator is followed by file name or descriptor number */
+    char *word = token[++i];
+    int src = -2;
 
-    /* is this token a redirection operator? */
-    if (token[i] == T_INPUT || token[i] == T_OUTPUT || token[i] == T_APPEND) {
-      mode = token[i];
+    if (failed)
+      continue;
+
+    if (mode == T_FD) {
+      if ((fd = fdnum(word)) >= NREDIRFD) {
+        msg("%s: bad file descriptor\n", word);
+        failed = true;
+      }
       continue;
     }
 
-    /* if not, copy and continue */
-    if (mode == NULL) {
-      token[n++] = token[i];
+    bool in = mode == T_INPUT || mode == T_HEREDOC || mode == T_HERESTR ||
+              mode == T_DUPIN || mode == T_RDWR;
+    if (fd < 0)
+      fd = in ? STDIN_FILENO : STDOUT_FILENO;
+
+    if (noexec && mode != T_DUPIN && mode != T_DUPOUT) {
+      fd = -1;
       continue;
     }
 
-    /* if it is, open the file and set the mode to NULL */
     if (mode == T_INPUT) {
-      *inputp = Open(token[i], O_RDONLY, 0);
-      mode = NULL;
-    } else if (mode == T_OUTPUT) {
-      *outputp = Open(token[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-      mode = NULL;
+      src = open(word, O_RDONLY | O_CLOEXEC);
+    } else if (mode == T_OUTPUT || mode == T_OUTERR) {
+      src = open(word, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
     } else if (mode == T_APPEND) {
-      *outputp = Open(token[i], O_WRONLY | O_CREAT | O_APPEND, 0644);
-      mode = NULL;
+      src = open(word, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    } else if (mode == T_RDWR) {
+      src = open(word, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    } else if (mode == T_HEREDOC || mode == T_HERESTR) {
+      /* here-document body was put in place of delimiter by `eval` */
+      src = herefd(word, mode == T_HERESTR);
+    } else if (mode == T_DUPIN || mode == T_DUPOUT) {
+      if ((src = fdnum(word)) < -1) {
+        msg("%s: bad file descriptor\n", word);
+        failed = true;
+      } else if (!noexec) {
+        addredir(fd, src, false);
+      }
+      fd = -1;
+      continue;
     }
 
+    if (src < 0) {
+      msg("%s: %s\n", word, strerror(errno));
+      failed = true;
+      continue;
+    }
+
+    addredir(fd, src, true);
+    if (mode == T_OUTERR)
+      addredir(STDERR_FILENO, STDOUT_FILENO, false);
+    fd = -1;
 #endif /* !STUDENT */
   }
 
   token[n] = NULL;
-  return n;
+  return failed ? -1 : n;
+}
+
+/* Make recorded redirections. Builtins and functions run within shell's
+ * process, so with `save` the descriptors they replace are kept aside to be
+ * restored by restoreredirs. On failure redirections made so far are undone
+ * if they were saved. */
+static void restoreredirs(int n);
+
+static int applyredirs(bool save) {
+  for (int i = 0; i < nredirs; i++) {
+    redir_t *r = &redirs[i];
+    int rc = 0;
+
+    if (save) {
+      int flags = fcntl(r->fd, F_GETFD);
+      r->saved = flags < 0 ? -1 : fcntl(r->fd, F_DUPFD_CLOEXEC, NREDIRFD);
+      r->cloexec = flags >= 0 && (flags & FD_CLOEXEC);
+    }
+
+    if (r->src < 0)
+      (void)close(r->fd);
+    else if (r->src == r->fd)
+      rc = fcntl(r->fd, F_SETFD, 0);
+    else
+      rc = dup3(r->src, r->fd, 0);
+
+    if (rc < 0) {
+      msg("%d: %s\n", r->src, strerror(errno));
+      if (save)
+        restoreredirs(i + 1);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void restoreredirs(int n) {
+  while (--n >= 0) {
+    redir_t *r = &redirs[n];
+    if (r->saved < 0) {
+      (void)close(r->fd);
+    } else {
+      dup3(r->saved, r->fd, r->cloexec ? O_CLOEXEC : 0);
+      Close(r->saved);
+    }
+  }
+}
+
+static int do_list(token_t *token, int ntokens, bool tail);
+
+/* Loop and function bodies are run straight from the tokens they were lexed
+ * into. Running a command rewrites its tokens in place, hence only the vector
+ * is copied before each run. */
+static int do_body(token_t *token, int start, int end) {
+  int n = end - start;
+  token_t body[n + 1];
+
+  memcpy(body, token + start, n * sizeof(token_t));
+  body[n] = NULL;
+  return do_list(body, n, false);
+}
+
+typedef struct func {
+  LIST_ENTRY(func) link;
+  char *name;
+  token_t *body;  /* copy of tokens between braces */
+  int ntokens;
+  int active;     /* number of calls in progress */
+  bool removed;   /* redefined during a call, free it when the call returns */
+} func_t;
+
+static LIST_HEAD(, func) funcs = LIST_HEAD_INITIALIZER(funcs);
+
+static func_t *findfunc(const char *name) {
+  func_t *f;
+  LIST_FOREACH(f, &funcs, link)
+    if (!strcmp(f->name, name))
+      return f;
+  return NULL;
+}
+
+static void freefunc(func_t *f) {
+  for (int i = 0; i < f->ntokens; i++)
+    if (string_p(f->body[i]))
+      free(f->body[i]);
+  free(f->body);
+  free(f->name);
+  free(f);
+}
+
+/* Function body has to outlive the command line it was defined in. */
+static int deffunc(const char *name, token_t *token, int ntokens) {
+  func_t *f = Malloc(sizeof(func_t));
+
+  f->name = strndup(name, strlen(name) - 2); /* strip "()" */
+  f->body = Malloc(sizeof(token_t) * (ntokens + 1));
+  for (int i = 0; i < ntokens; i++)
+    f->body[i] = string_p(token[i]) ? strdup(token[i]) : token[i];
+  f->body[ntokens] = NULL;
+  f->ntokens = ntokens;
+  f->active = 0;
+  f->removed = false;
+
+  func_t *old = findfunc(f->name);
+  if (old) {
+    LIST_REMOVE(old, link);
+    if (old->active)
+      old->removed = true;
+    else
+      freefunc(old);
+  }
+  LIST_INSERT_HEAD(&funcs, f, link);
+  return 0;
+}
+
+/* Function arguments become positional parameters for the time of the call. */
+static int callfunc(func_t *f, token_t *argv) {
+  int argc = 0, oldargc;
+  while (argv[argc])
+    argc++;
+
+  char **oldargv = setparams(argv, argc - 1, &oldargc);
+  f->active++;
+  int exitcode = do_body(f->body, 0, f->ntokens);
+  if (--f->active == 0 && f->removed)
+    freefunc(f);
+  setparams(oldargv, oldargc, NULL);
+  return exitcode;
+}
+
+/* Subprocess that is about to exec a command runs a function instead. */
+static void execfunc(token_t *argv) {
+  func_t *f = findfunc(argv[0]);
+  if (f == NULL)
+    return;
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  subshelljobs();
+  exit(callfunc(f, argv));
+}
+
+static int eval(char *cmdline);
+
+/* Subprocess that runs commands on behalf of the shell, e.g. a substituted
+ * command, starts with default signal handling and no jobs. It runs command
+ * line `cmdline` the way one-shot mode does, or `argv` if it's given. */
+noreturn void subshell(char *cmdline, token_t *argv) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  Signal(SIGINT, SIG_DFL);
+  Signal(SIGTSTP, SIG_DFL);
+  Signal(SIGTTIN, SIG_DFL);
+  Signal(SIGTTOU, SIG_DFL);
+  subshelljobs();
+
+  if (argv == NULL) {
+    cmdstr = "";
+    exit(eval(cmdline));
+  }
+
+  int exitcode;
+  execfunc(argv);
+  if ((exitcode = builtin_command(argv)) >= 0)
+    exit(exitcode);
+  external_command(argv);
+}
+
+/* Process substitutions of the command that is about to be started. Each
+ * command is connected to its pipe, the shell holds both ends of the pipe
+ * until all processes of the job are started. */
+typedef struct {
+  char *cmd;  /* command line to run */
+  int fd;     /* pipe end passed as /dev/fd/N, inherited through exec */
+  int subfd;  /* pipe end used as stdin or stdout of `cmd` */
+  bool out;   /* >(cmd) rather than <(cmd) */
+} subst_t;
+
+static subst_t *substs = NULL;
+static int nsubsts = 0;
+
+/* Returns /dev/fd/N path that replaces `<(cmd)` or `>(cmd)` argument. */
+static char *procsubst(const char *cmd, bool out) {
+  int rd, wr;
+  char *path;
+
+  mkpipe(&rd, &wr);
+  substs = Realloc(substs, sizeof(subst_t) * (nsubsts + 1));
+  subst_t *sub = &substs[nsubsts++];
+  sub->cmd = strdup(cmd);
+  sub->fd = highfd(out ? wr : rd, false);
+  sub->subfd = out ? rd : wr;
+  sub->out = out;
+
+  if (asprintf(&path, "/dev/fd/%d", sub->fd) < 0)
+    app_error("ERROR: Out of memory!");
+  return path;
+}
+
+static void closesubsts(void) {
+  for (int i = 0; i < nsubsts; i++) {
+    MaybeClose(&substs[i].fd);
+    MaybeClose(&substs[i].subfd);
+    free(substs[i].cmd);
+  }
+  free(substs);
+  substs = NULL;
+  nsubsts = 0;
+}
+
+/* Command that uses substitutions gets /dev/fd/N descriptors, but it must
+ * not hold the other pipe ends, or they'd never see EOF. These are closed
+ * on exec, so it matters only for functions and builtins. */
+static void closesubfds(void) {
+  for (int i = 0; i < nsubsts; i++)
+    MaybeClose(&substs[i].subfd);
+}
+
+/* Substituted commands join process group `pgid` of the job (if any) that
+ * uses them. Each runs in a subshell that replaces itself with its last
+ * command, just like in one-shot mode. The shell keeps the other pipe ends,
+ * until the caller has started the command that uses them. */
+static void startsubsts(pid_t pgid, int job) {
+  for (int i = 0; i < nsubsts; i++) {
+    pid_t pid = spawn();
+
+    if (pid == 0) {
+      subst_t *sub = &substs[i];
+      char *cmd = sub->cmd;
+      sub->cmd = NULL;
+      setpgid(0, pgid);
+      Dup2(sub->subfd, sub->out ? STDIN_FILENO : STDOUT_FILENO);
+      closesubsts();
+      /* redirections belong to the command that uses the substitution */
+      closeredirs();
+      subshell(cmd, NULL);
+    }
+
+    setpgid(pid, pgid);
+    if (job >= 0)
+      addproc(job, pid, NULL);
+  }
+
+  closesubfds();
+}
+
+/* Builtin run within the shell must not get it killed by SIGPIPE when the
+ * reader of its output goes away. The signal is blocked, so writes fail with
+ * EPIPE instead, and dropped afterwards. In a subprocess it's left alone,
+ * so a builtin stage dies of it like any other command. */
+static int inshell_builtin(token_t *argv) {
+  sigset_t pipemask, mask, pending;
+  int sig;
+
+  sigemptyset(&pipemask);
+  sigaddset(&pipemask, SIGPIPE);
+  Sigprocmask(SIG_BLOCK, &pipemask, &mask);
+  int exitcode = builtin_command(argv);
+  sigpending(&pending);
+  if (sigismember(&pending, SIGPIPE))
+    sigwait(&pipemask, &sig);
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return exitcode;
 }
 
+/* Set while starting a background job that admission control holds back,
+ * see admit.c. Its processes stop themselves right before exec. */
+static bool holdjob = false;
+
 /* Execute internal command within shell's process or execute external command
- * in a subprocess. External command can be run in the background. */
+ * in a subprocess. External command can be run in the background. Command
+ * that uses process substitution always runs in a subprocess, so that it can
+ * share its process group with substituted commands. */
 static int do_job(token_t *token, int ntokens, bool bg) {
-  int input = -1, output = -1;
   int exitcode = 0;
 
-  ntokens = do_redir(token, ntokens, &input, &output);
+  if ((ntokens = do_redir(token, ntokens)) < 0)
+    return 1;
 
-  if (!bg) {
-    if ((exitcode = builtin_command(token)) >= 0)
+  /* files are opened (and created or truncated) by do_redir already */
+  if (ntokens == 0)
+    return 0;
+
+  /* only functions and builtins get redirections made to the shell itself */
+  func_t *f = findfunc(token[0]);
+  if (!bg && nsubsts == 0 && (f || builtin_p(token[0]))) {
+    if (applyredirs(true) < 0)
+      return 1;
+    /* commands run by a function make their own redirections */
+    redir_t *r = redirs;
+    int n = nredirs;
+    redirs = NULL;
+    nredirs = 0;
+    exitcode = f ? callfunc(f, token) : inshell_builtin(token);
+    redirs = r;
+    nredirs = n;
+    restoreredirs(n);
+    if (exitcode >= 0)
       return exitcode;
+    exitcode = 0;
   }
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  holdjob = bg && !admitjob();
 
   /* TODO: Start a subprocess, create a job and monitor it. */
 #ifdef STUDENT
@@ -90,7 +528,7 @@ static int do_job(token_t *token, int ntokens, bool bg) {
   sigaddset(&sigcont_Mask, SIGCONT);
   Sigprocmask(SIG_BLOCK, &sigcont_Mask, NULL);
 
-  pid_t pid = Fork();
+  pid_t pid = spawn();
 
   switch (pid) {
     case -1:
@@ -100,11 +538,12 @@ static int do_job(token_t *token, int ntokens, bool bg) {
 
     case 0:
       // **child**
-      // set the process group id to the pid
-      setpgid(0, 0);
+      // set the process group id to the pid, if there's job control
+      setpgid(0, jobpgrp(0));
 
-      // pause until SIGCONT is received
-      if (!bg) {
+      // with job control, pause until SIGCONT is received, i.e. until the
+      // shell has handed over the terminal
+      if (!bg && jobpgrp(0) == 0) {
         sigset_t pendingMask;
         while (1) {
           sigpending(&pendingMask);
@@ -119,15 +558,9 @@ static int do_job(token_t *token, int ntokens, bool bg) {
       sigemptyset(&blankMask);
       Sigprocmask(SIG_SETMASK, &blankMask, NULL);
 
-      // set the input and output file descriptors and close duplicates
-      if (input != -1) {
-        dup2(input, STDIN_FILENO);
-        MaybeClose(&input);
-      }
-      if (output != -1) {
-        dup2(output, STDOUT_FILENO);
-        MaybeClose(&output);
-      }
+      // make redirections, files opened by the shell are closed on exec
+      if (applyredirs(false) < 0)
+        exit(1);
 
       // reset signal handlers
       Signal(SIGINT, SIG_DFL);
@@ -135,7 +568,15 @@ static int do_job(token_t *token, int ntokens, bool bg) {
       Signal(SIGTTIN, SIG_DFL);
       Signal(SIGTTOU, SIG_DFL);
 
+      // wait for admission, if the job is held back
+      if (holdjob)
+        raise(SIGSTOP);
+
       // execute the command
+      closesubfds();
+      execfunc(token);
+      if ((exitcode = builtin_command(token)) >= 0)
+        exit(exitcode);
       external_command(token);
 
       // hopefully unreachable
@@ -147,44 +588,51 @@ static int do_job(token_t *token, int ntokens, bool bg) {
       // unblock SIGCONT and block SIGCHLD
       Sigprocmask(SIG_SETMASK, &sigchld_mask, NULL);
 
-      // set the process group id to the pid
-      setpgid(pid, pid);
+      // set the process group id to the pid, if there's job control
+      pid_t pgid = jobpgrp(pid);
+      setpgid(pid, pgid);
 
       // add the job to the job list
-      int job_id = addjob(pid, bg);
+      int job_id = addjob(pgid, bg);
 
       // add the process to the process list
       addproc(job_id, pid, token);
+      startsubsts(pgid, job_id);
+      closesubsts();
 
-      // close the input and output file descriptors
-      MaybeClose(&input);
-      MaybeClose(&output);
+      // close files opened for redirections
+      closeredirs();
 
       // if the command is not in the background, monitor it
       if (!bg) {
         exitcode = monitorjob(&mask);
       } else {
-        msg("[%d] running '%s'\n", job_id, jobcmd(job_id));
+        msg("[%d] %s '%s'\n", job_id, holdjob ? "queued" : "running",
+            jobcmd(job_id));
+        if (holdjob)
+          queuejob(job_id);
       }
   }
 
 #endif /* !STUDENT */
 
+  holdjob = false;
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return exitcode;
 }
 
 /* Start internal or external command in a subprocess that belongs to pipeline.
- * All subprocesses in pipeline must belong to the same process group. */
-static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
-                      token_t *token, int ntokens, bool bg) {
-  ntokens = do_redir(token, ntokens, &input, &output);
-
-  if (ntokens == 0)
-    app_error("ERROR: Command line is not well formed!");
+ * All subprocesses in pipeline must belong to the same process group. Pipe
+ * ends the shell holds for other stages are given in `spare`. These are
+ * closed on exec, but a builtin holding the read end of its own output pipe
+ * would never get EPIPE, so the subprocess closes them anyway. */
+static pid_t do_stage(pid_t pgid, int input, int output, const int *spare,
+                      int nspare, token_t *token, int ntokens) {
+  /* a stage whose redirections fail still takes its place in the pipeline */
+  ntokens = do_redir(token, ntokens);
 
   /* TODO: Start a subprocess and make sure it's moved to a process group. */
-  pid_t pid = Fork();
+  pid_t pid = spawn();
 #ifdef STUDENT
 
   switch (pid) {
@@ -198,11 +646,10 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
       // set the process group id to the pgid
       setpgid(0, pgid);
 
-      // check if command is internal, and run it
-      int exitcode = -1;
-      if ((exitcode = builtin_command(token)) >= 0) {
-        exit(exitcode);
-      }
+      // close pipe ends that belong to other stages
+      for (int i = 0; i < nspare; i++)
+        if (spare[i] >= 0)
+          Close(spare[i]);
 
       // set the input and output file descriptors and close duplicates
       if (input != -1) {
@@ -213,6 +660,10 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
         dup2(output, STDOUT_FILENO);
         MaybeClose(&output);
       }
+      if (ntokens < 0 || applyredirs(false) < 0)
+        exit(1);
+      if (ntokens == 0)
+        exit(0);
 
       // reset signal handlers
       Signal(SIGINT, SIG_DFL);
@@ -220,7 +671,16 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
       Signal(SIGTTIN, SIG_DFL);
       Signal(SIGTTOU, SIG_DFL);
 
-      // execute the external command
+      // wait for admission, if the job is held back
+      if (holdjob)
+        raise(SIGSTOP);
+
+      // execute the function, internal or external command
+      closesubfds();
+      execfunc(token);
+      int exitcode;
+      if ((exitcode = builtin_command(token)) >= 0)
+        exit(exitcode);
       external_command(token);
 
       // hopefully unreachable
@@ -230,6 +690,7 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
       // parent
       // set the process group id to the pgid
       setpgid(pid, pgid);
+      closeredirs();
       break;
   }
 
@@ -238,17 +699,37 @@ static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
   return pid;
 }
 
-static void mkpipe(int *readp, int *writep) {
-  int fds[2];
-  Pipe(fds);
-  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
-  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
-  *readp = fds[0];
-  *writep = fds[1];
+/* Start a relay that measures flow between two pipeline stages. It gets
+ * both of its pipe ends and closes `other` one the shell holds. */
+static pid_t do_relay(pid_t pgid, pipestat_t *ps, int edge, int in, int out,
+                      int other) {
+  pid_t pid = spawn();
+
+  if (pid == 0) {
+    setpgid(0, pgid);
+    if (other >= 0)
+      Close(other);
+    closesubfds();
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    Signal(SIGTTIN, SIG_DFL);
+    Signal(SIGTTOU, SIG_DFL);
+
+    pipestat_relay(ps, edge, in, out);
+  }
+
+  setpgid(pid, pgid);
+  return pid;
 }
 
 /* Pipeline execution creates a multiprocess job. Both internal and external
- * commands are executed in subprocesses. */
+ * commands are executed in subprocesses. Each stage is run straight from the
+ * token vector, separating pipe is replaced with NULL to terminate it. Shell
+ * only makes a pipe, forks and closes its ends of the pipe for a stage. */
 static int do_pipeline(token_t *token, int ntokens, bool bg) {
   pid_t pid, pgid = 0;
   int job = -1;
@@ -256,10 +737,30 @@ static int do_pipeline(token_t *token, int ntokens, bool bg) {
 
   int input = -1, output = -1, next_input = -1;
 
-  mkpipe(&next_input, &output);
+  /* Default pipe size, foreground pipes may also grow when they fill up. */
+  const char *spec = getenv("PIPESIZE");
+  bool adaptive = spec && !strcmp(spec, "auto");
+  long defsize = spec && !adaptive ? pipesize(spec) : -1;
+  bool grow = false, grow_next = false;
+
+  /* With PIPESTAT set, stages are connected through measuring relays. */
+  const char *stat = getenv("PIPESTAT");
+  pipestat_t *ps = NULL;
+  int relay_in = -1, relay_out = -1;
+
+  if (stat && *stat) {
+    int nstages = 1;
+    for (int i = 0; i < ntokens; i++)
+      nstages += token[i] == T_PIPE;
+    ps = pipestat_new(nstages);
+  }
+
+  /* With PIPEFAIL set, a failed stage stops the stages that feed it. */
+  const char *fail = getenv("PIPEFAIL");
 
   sigset_t mask;
   Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  holdjob = bg && !admitjob();
 
   /* TODO: Start pipeline subprocesses, create a job and monitor it.
    * Remember to close unused pipe ends! */
@@ -270,44 +771,66 @@ static int do_pipeline(token_t *token, int ntokens, bool bg) {
   (void)pgid;
   (void)do_stage;
 
-  // Closing pipe because i don't need it now
-  MaybeClose(&next_input);
-  MaybeClose(&output);
-
   // initialize variables required for the loop
   int i = 0;
   int stages = 0;
-  token_t *queue = calloc(ntokens + 1, sizeof(token_t));
-  int queue_size = 0;
+  int start = 0;
 
-  // loop through the tokens, save the tokens in a queue until a pipe is found
-  // when a pipe is found, create a new process with the queue as command, and
-  // pipe as input/output
+  // loop through the tokens until a pipe is found, then create a new process
+  // with the tokens since the previous pipe as command, and pipe as
+  // input/output
   for (i = 0; i < ntokens + 1; i++) {
     if (token[i] == T_PIPE || i == ntokens) {
-      // end the queue
-      queue[queue_size] = '\0';
+      // end the command of this stage
+      token_t *queue = &token[start];
+      int queue_size = i - start;
+      token[i] = NULL;
 
       // save pipe output as next input
       input = next_input;
+      grow = grow_next;
 
       // create a pipe if it's not the last stage
+      // its size may be given explicitly with `|{SIZE}`
       if (i != ntokens) {
         mkpipe(&next_input, &output);
+        long size = defsize;
+        grow_next = adaptive && !bg;
+        if (token[i + 1] == T_PIPESZ) {
+          if ((size = pipesize(token[i + 2])) < 0)
+            msg("warning: invalid pipe size '%s'\n", token[i + 2]);
+          grow_next = false;
+          i += 2;
+        }
+        setpipesize(output, size);
+        if (ps) {
+          relay_in = next_input;
+          mkpipe(&next_input, &relay_out);
+          setpipesize(relay_out, size);
+        }
       }
 
+      // pipe ends the stage must not hold, next_input is stale after the
+      // last pipe has been made
+      int spare[] = {i != ntokens ? next_input : -1, relay_in, relay_out};
+
       // create a new process
       // if it is the first process, set the pgid to the pid
       // if it is the last process, close the output
       if (stages == 0) {
-        pgid = pid = do_stage(0, &mask, -1, output, queue, queue_size, bg);
+        pid = do_stage(jobpgrp(0), -1, output, spare, 3, queue, queue_size);
+        pgid = jobpgrp(pid);
         MaybeClose(&output);
       } else if (i == ntokens) {
         MaybeClose(&output);
-        pid = do_stage(pgid, &mask, input, -1, queue, queue_size, bg);
+        pid = do_stage(pgid, input, -1, spare, 3, queue, queue_size);
+        if (grow)
+          watchpipe(pid, input);
         MaybeClose(&input);
       } else {
-        pid = do_stage(pgid, &mask, input, output, queue, queue_size, bg);
+        pid = do_stage(pgid, input, output, spare, 3, queue, queue_size);
+        if (grow)
+          watchpipe(pid, input);
         MaybeClose(&input);
         MaybeClose(&output);
       }
@@ -316,29 +839,46 @@ static int do_pipeline(token_t *token, int ntokens, bool bg) {
       // if it is the first process, add the job to the job list
       if (stages == 0) {
         job = addjob(pgid, bg);
+        if (ps)
+          setjobstat(job, ps);
+        if (fail && *fail)
+          setjobpipefail(job);
       }
       addproc(job, pid, queue);
 
+      // start the relay that passes this stage's output to the next one
+      if (ps) {
+        pipestat_setcmd(ps, stages, queue);
+        if (relay_in >= 0) {
+          pid = do_relay(pgid, ps, stages, relay_in, relay_out, next_input);
+          addproc(job, pid, NULL);
+          MaybeClose(&relay_in);
+          MaybeClose(&relay_out);
+        }
+      }
+
       stages++;
-      // reset the queue
-      queue_size = 0;
-    } else {
-      // append the token to the queue
-      queue[queue_size++] = token[i];
+      // next stage starts after the pipe and its size
+      start = i + 1;
     }
   }
 
+  startsubsts(pgid, job);
+  closesubsts();
+
   // monitor the job
   if (!bg) {
+    growpipes(true);
     exitcode = monitorjob(&mask);
+    growpipes(false);
   } else {
-    msg("[%d] running '%s'\n", job, jobcmd(job));
+    msg("[%d] %s '%s'\n", job, holdjob ? "queued" : "running", jobcmd(job));
+    if (holdjob)
+      queuejob(job);
   }
-
-  // free the queue
-  free(queue);
 #endif /* !STUDENT */
 
+  holdjob = false;
   Sigprocmask(SIG_SETMASK, &mask, NULL);
   return exitcode;
 }
@@ -350,96 +890,848 @@ static bool is_pipeline(token_t *token, int ntokens) {
   return false;
 }
 
-static void eval(char *cmdline) {
-  bool bg = false;
-  int ntokens;
-  token_t *token = tokenize(cmdline, &ntokens);
+/* Coprocess is a background job that talks with the shell over a socket,
+ * which is both its standard input and output. Shell's end of the socket is
+ * closed on exec like other descriptors the shell keeps, commands get it by
+ * redirection from the number in COPROC_FD variable, e.g. `>&$COPROC_FD`,
+ * so a helper started once can serve any number of requests. Starting next
+ * coprocess closes the socket of the previous one. */
+static int coproc_fd = -1;
+
+static int do_coproc(token_t *token, int ntokens) {
+  int sv[2];
+  char buf[16];
+
+  if (ntokens == 0) {
+    msg("coproc: missing command\n");
+    return 2;
+  }
+
+  sigset_t mask;
+  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+  MaybeClose(&coproc_fd);
+  Socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+  int output = fcntl(sv[1], F_DUPFD_CLOEXEC, 0);
+  pid_t pid =
+    do_stage(jobpgrp(0), sv[1], output, &sv[0], 1, token, ntokens);
+  Close(sv[1]);
+  Close(output);
+  coproc_fd = highfd(sv[0], true);
+
+  int job = addjob(jobpgrp(pid), BG);
+  addproc(job, pid, token);
+  msg("[%d] running '%s'\n", job, jobcmd(job));
+
+  snprintf(buf, sizeof(buf), "%d", coproc_fd);
+  setenv("COPROC_FD", buf, 1);
+  snprintf(buf, sizeof(buf), "%d", (int)pid);
+  setenv("COPROC_PID", buf, 1);
+
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  return 0;
+}
+
+static const char *opname[] = {
+  [1] = "&&", [2] = "||", [3] = "|", [4] = "&", [5] = ";",
+  [6] = ">",  [7] = "<",  [8] = ">>", [9] = "!", [10] = "<<", [11] = "<<<",
+  [12] = "|{}", [13] = "<()", [14] = ">()", [15] = "n>", [16] = ">&",
+  [17] = "<&", [18] = "<>", [19] = "&>",
+};
+
+static const char *tokname(token_t t) {
+  return string_p(t) ? t : opname[(long)t];
+}
+
+static bool keyword_p(token_t t, const char *kw) {
+  return string_p(t) && !strcmp(t, kw);
+}
+
+/* Function definition starts with a word like `name()`. */
+static bool funcdef_p(token_t t) {
+  size_t n = string_p(t) ? strlen(t) : 0;
+  return n > 2 && !strcmp(t + n - 2, "()");
+}
+
+/* Returns by how much `t` changes nesting depth of compound commands, i.e.
+ * `for`, `while` and `{` open one, `done` and `}` close one. Keywords are
+ * recognized only at the start of a command, `*startp` tells if `t` is there
+ * and gets updated for the token that follows. */
+static int nesting(token_t t, bool *startp) {
+  bool start = *startp;
+
+  if (!string_p(t)) {
+    *startp = !redir_p(t);
+    return 0;
+  }
+
+  *startp = start && (keyword_p(t, "while") || keyword_p(t, "do") ||
+                      keyword_p(t, "{") || funcdef_p(t));
+  if (!start)
+    return 0;
+  if (keyword_p(t, "for") || keyword_p(t, "while") || keyword_p(t, "{"))
+    return 1;
+  if (keyword_p(t, "done") || keyword_p(t, "}"))
+    return -1;
+  return 0;
+}
 
-  if (ntokens > 0 && token[ntokens - 1] == T_BGJOB) {
-    token[--ntokens] = NULL;
-    bg = true;
+/* Returns the index of keyword `kw` that starts a command within token[i..n)
+ * and is not nested in another compound command, or -1 if there's none. */
+static int findkw(token_t *token, int i, int n, bool start, const char *kw) {
+  for (int depth = 0; i < n; i++) {
+    if (depth == 0 && start && keyword_p(token[i], kw))
+      return i;
+    depth += nesting(token[i], &start);
   }
+  return -1;
+}
+
+/* Check that every pipeline stage has a command, every operator joining two
+ * commands is followed by one and every redirection operator is followed by
+ * a file name, so that no job gets started for a malformed command line.
+ * Compound commands must be closed with matching keywords. */
+static bool well_formed(token_t *token, int ntokens) {
+  token_t sep = T_COLON; /* operator preceding current command */
+  bool bang = false;
+  int words = 0;
+  char open[ntokens + 1]; /* closing keywords of open compound commands */
+  int depth = 0;
+  bool start = true;
 
-  if (ntokens > 0) {
-    if (is_pipeline(token, ntokens)) {
-      do_pipeline(token, ntokens, bg);
+  for (int i = 0; i < ntokens; i++) {
+    token_t t = token[i];
+    int delta = nesting(t, &start);
+
+    if (delta > 0) {
+      /* compound commands take neither pipes nor redirections */
+      if (sep == T_PIPE) {
+        msg("syntax error: unexpected '%s' in a pipeline\n", t);
+        return false;
+      }
+      open[depth++] = *t == '{' ? '}' : 'd';
+    } else if (delta < 0 && (depth == 0 || open[--depth] != *t)) {
+      msg("syntax error: unexpected '%s'\n", t);
+      return false;
+    } else if (delta < 0 && i + 1 < ntokens &&
+               !(token[i + 1] == T_COLON || token[i + 1] == T_AND ||
+                 token[i + 1] == T_OR)) {
+      msg("syntax error: unexpected '%s' after '%s'\n",
+          tokname(token[i + 1]), t);
+      return false;
+    }
+
+    if (redir_p(t)) {
+      token_t next = i + 1 < ntokens ? token[i + 1] : T_NULL;
+      /* file name can be given by process substitution, e.g. `> >(cmd)` */
+      bool file = t <= T_APPEND || t == T_RDWR || t == T_OUTERR;
+      if (file && (next == T_PSUBIN || next == T_PSUBOUT))
+        continue;
+      if (!string_p(next)) {
+        msg("syntax error: missing file name after '%s'\n", opname[(long)t]);
+        return false;
+      }
+      i++;
+      words++; /* redirections alone make a command, e.g. `> file` */
+    } else if (t == T_BANG) {
+      if (words > 0 || sep == T_PIPE) {
+        msg("syntax error: unexpected '!'\n");
+        return false;
+      }
+      bang = true;
+    } else if (string_p(t)) {
+      /* keyword that is followed by a command, e.g. `while` or `do` */
+      words = start ? 0 : words + 1;
     } else {
-      do_job(token, ntokens, bg);
+      if (words == 0) {
+        msg("syntax error: missing command before '%s'\n", opname[(long)t]);
+        return false;
+      }
+      sep = t;
+      bang = false;
+      words = 0;
     }
   }
 
-  free(token);
+  if (words == 0 && (bang || sep == T_PIPE || sep == T_AND || sep == T_OR)) {
+    msg("syntax error: missing command after '%s'\n",
+        opname[bang ? (long)T_BANG : (long)sep]);
+    return false;
+  }
+
+  if (depth > 0) {
+    msg("syntax error: missing '%s'\n", open[depth - 1] == '}' ? "}" : "done");
+    return false;
+  }
+
+  return true;
+}
+
+/* In one-shot mode (-c) the last command of command line replaces the shell
+ * process, since the shell would only wait for it and exit afterwards. */
+static noreturn void do_exec(token_t *token, int ntokens) {
+  int exitcode;
+
+  if (do_redir(token, ntokens) < 0)
+    exit(1);
+  startsubsts(getpgrp(), -1);
+  if (applyredirs(false) < 0)
+    exit(1);
+  closeredirs();
+
+  func_t *f = findfunc(token[0]);
+  if (f)
+    exit(callfunc(f, token));
+  if ((exitcode = builtin_command(token)) >= 0)
+    exit(exitcode);
+  external_command(token);
 }
 
-#ifndef READLINE
-static char *readline(const char *prompt) {
-  static char line[MAXLINE]; /* `readline` is clearly not reentrant! */
+/* Only an external command may replace the shell at the end of one-shot
+ * mode, functions and builtins run within it anyway. */
+static bool external_p(token_t *token, int ntokens) {
+  for (int i = 0; i < ntokens; i++) {
+    if (redir_p(token[i]))
+      i++;
+    else
+      return !findfunc(token[i]) && !builtin_p(token[i]);
+  }
+  return false;
+}
+
+/* `exec cmd` replaces the shell with a command. Without a command its
+ * redirections are made to the shell itself, so the descriptors stay open
+ * and every later command inherits them. A script can open its log once with
+ * `exec 3>>log` rather than on each command, and close it with `exec 3>&-`. */
+static int do_execredir(token_t *token, int ntokens) {
+  for (int i = 0; i < ntokens; i++) {
+    if (redir_p(token[i]))
+      i++;
+    else
+      do_exec(token, ntokens);
+  }
+
+  if (nsubsts > 0) {
+    msg("exec: process substitution can't be kept open\n");
+    return 1;
+  }
+  if (do_redir(token, ntokens) < 0 || applyredirs(false) < 0)
+    return 1;
+  return 0;
+}
+
+/* Loops are interrupted by SIGINT sent to the shell or to a command. */
+static bool stop_p(int exitcode) {
+  return interrupted || exitcode == 128 + SIGINT;
+}
+
+/* for NAME in WORDS; do LIST; done */
+static int do_for(token_t *token, int ntokens) {
+  int body = findkw(token, 2, ntokens - 1, false, "do");
+  int exitcode = 0;
+
+  if (ntokens < 3 || !string_p(token[1]) || !keyword_p(token[2], "in") ||
+      body < 0) {
+    msg("syntax error: expected 'for NAME in WORDS; do LIST; done'\n");
+    return 2;
+  }
+
+  for (int i = 3; i < body && string_p(token[i]); i++) {
+    char *word = expand(token[i]);
+    if (*word) {
+      setenv(token[1], word, 1);
+      exitcode = do_body(token, body + 1, ntokens - 1);
+    }
+    free(word);
+    if (stop_p(exitcode))
+      break;
+  }
+
+  return exitcode;
+}
+
+/* while LIST; do LIST; done */
+static int do_while(token_t *token, int ntokens) {
+  int body = findkw(token, 1, ntokens - 1, true, "do");
+  int exitcode = 0;
+
+  if (body <= 1) {
+    msg("syntax error: expected 'while LIST; do LIST; done'\n");
+    return 2;
+  }
+
+  while (!interrupted && do_body(token, 1, body) == 0) {
+    exitcode = do_body(token, body + 1, ntokens - 1);
+    if (stop_p(exitcode))
+      break;
+  }
+
+  return exitcode;
+}
+
+/* Returns the index at which a compound command starts among tokens of
+ * a command, or -1 if it's a simple command or a pipeline. */
+static int compound(token_t *token, int ntokens) {
+  bool start = true;
+  for (int i = 0; i < ntokens; i++) {
+    if (start && funcdef_p(token[i]))
+      return i;
+    if (nesting(token[i], &start) > 0)
+      return i;
+  }
+  return -1;
+}
+
+/* Loops, groups and function definitions are run by the shell itself. They
+ * are lexed once, so their bodies are not parsed again on each iteration. */
+static int do_compound(token_t *token, int ntokens, bool bg) {
+  int i = funcdef_p(token[0]); /* function body follows its name */
+  int depth = 0;
+  bool start = true;
+
+  if (i && (ntokens < 2 || !keyword_p(token[1], "{"))) {
+    msg("syntax error: expected '{' after '%s'\n", token[0]);
+    return 2;
+  }
+
+  do {
+    depth += nesting(token[i++], &start);
+  } while (depth > 0 && i < ntokens);
+
+  if (i < ntokens || bg) {
+    msg("syntax error: unexpected '%s' after '%s'\n",
+        i < ntokens ? tokname(token[i]) : "&", tokname(token[i - 1]));
+    return 2;
+  }
+
+  if (keyword_p(token[0], "for"))
+    return do_for(token, ntokens);
+  if (keyword_p(token[0], "while"))
+    return do_while(token, ntokens);
+  if (keyword_p(token[0], "{"))
+    return do_body(token, 1, ntokens - 1);
+  return deffunc(token[0], token + 2, ntokens - 3);
+}
+
+/* Command that consists of assignments only sets shell variables. */
+static bool do_assign(token_t *token, int ntokens) {
+  for (int i = 0; i < ntokens; i++)
+    if (!string_p(token[i]) || !assignment_p(token[i]))
+      return false;
+
+  for (int i = 0; i < ntokens; i++) {
+    char *word = expand(token[i]);
+    char *value = strchr(word, '=');
+    *value++ = '\0';
+    setenv(word, value, 1);
+    free(word);
+  }
+
+  return true;
+}
+
+/* Expand variables in words of a simple command or a pipeline into `argv`.
+ * Words that expand to nothing are dropped, unless they name a file.
+ * Process substitutions are replaced with paths of their pipes.
+ * Expanded words are put into `owned` to be freed by the caller. */
+static int expandcmd(token_t *token, int ntokens, token_t *argv, char **owned,
+                     int *nownedp) {
+  int argc = 0;
+
+  for (int i = 0; i < ntokens; i++) {
+    token_t t = token[i];
+    bool file = i > 0 && redir_p(token[i - 1]);
+
+    if ((t == T_PSUBIN || t == T_PSUBOUT) && i + 1 < ntokens) {
+      bool out = t == T_PSUBOUT;
+      argv[argc++] = owned[(*nownedp)++] = procsubst(token[++i], out);
+      continue;
+    }
+
+    if (string_p(t) && strchr(t, '$') && !(file && token[i - 1] == T_HEREDOC)) {
+      t = owned[(*nownedp)++] = expand(t);
+      if (*t == '\0' && !file)
+        continue;
+    }
+    argv[argc++] = t;
+  }
+
+  argv[argc] = NULL;
+  return argc;
+}
+
+/* Run a compound command or a pipeline, possibly negated with `!`. */
+static int do_command(token_t *token, int ntokens, bool bg, bool last) {
+  bool negate = false;
+  int exitcode = 0;
+
+  for (; ntokens > 0 && token[0] == T_BANG; token++, ntokens--)
+    negate = !negate;
+
+  int c = compound(token, ntokens);
+
+  if (c == 0) {
+    exitcode = do_compound(token, ntokens, bg);
+  } else if (c > 0) {
+    msg("syntax error: unexpected '%s' in a pipeline\n", token[c]);
+    exitcode = 2;
+  } else if (do_assign(token, ntokens)) {
+    exitcode = 0;
+  } else {
+    token_t argv[ntokens + 1];
+    char *owned[ntokens];
+    int nowned = 0;
+    int argc = expandcmd(token, ntokens, argv, owned, &nowned);
+
+    if (argc == 0) {
+      exitcode = 0;
+    } else if (nowned > 0 && !well_formed(argv, argc)) {
+      exitcode = 2;
+    } else if (keyword_p(argv[0], "exec")) {
+      exitcode = do_execredir(argv + 1, argc - 1);
+    } else if (keyword_p(argv[0], "coproc")) {
+      if (is_pipeline(argv, argc)) {
+        msg("coproc: pipeline can't be a coprocess\n");
+        exitcode = 2;
+      } else {
+        exitcode = do_coproc(argv + 1, argc - 1);
+      }
+    } else if (is_pipeline(argv, argc)) {
+      exitcode = do_pipeline(argv, argc, bg);
+    } else if (last && !negate && cmdstr && *cmdstr == '\0' && !bg &&
+               external_p(argv, argc)) {
+      do_exec(argv, argc);
+    } else {
+      exitcode = do_job(argv, argc, bg);
+    }
+
+    closesubsts(); /* in case the command wasn't started */
+    closeredirs();
+    while (nowned > 0)
+      free(owned[--nowned]);
+  }
+
+  return negate ? !exitcode : exitcode;
+}
+
+/* Returns the index of separator that ends the command starting at token[i].
+ * Separators within compound commands belong to their bodies. */
+static int cmdend(token_t *token, int i, int ntokens) {
+  bool start = true;
+
+  for (int depth = 0; i < ntokens; i++) {
+    token_t t = token[i];
+    if (depth == 0 && (t == T_COLON || t == T_BGJOB || t == T_AND || t == T_OR))
+      break;
+    depth += nesting(t, &start);
+  }
+
+  return i;
+}
+
+/* Command line is a list of pipelines. Those separated by `;` or `&` are run
+ * unconditionally, `&&` (`||`) runs next pipeline only if the previous one
+ * succeeded (failed). Returns exit code of last pipeline that was run.
+ * Only the last command of a top level list (`tail`) may replace the shell. */
+static int do_list(token_t *token, int ntokens, bool tail) {
+  token_t cond = T_NULL;
+  int exitcode = 0;
+
+  for (int start = 0; start < ntokens;) {
+    int i = cmdend(token, start, ntokens);
+    token_t sep = token[i];
+
+    token[i] = NULL;
+
+    if (i > start && (cond != T_AND || exitcode == 0) &&
+        (cond != T_OR || exitcode != 0)) {
+      bool last = tail && i >= ntokens - 1 && sep != T_BGJOB;
+      exitcode = do_command(token + start, i - start, sep == T_BGJOB, last);
+      lastexitcode = exitcode;
+    }
+
+    cond = (sep == T_AND || sep == T_OR) ? sep : T_NULL;
+    start = i + 1;
+  }
 
-  if (write(STDOUT_FILENO, prompt, strlen(prompt))) {};
+  return exitcode;
+}
+
+#define SCRIPT_READAHEAD 4 /* buffers of script read ahead in io_uring */
+
+static rio_t input;       /* buffered command input: terminal, pipe or script */
+static bool interactive;  /* commands are typed in by the user at a terminal */
+
+/* Read next command line from `-c` string or from `input`, print `prompt`
+ * first if it's given. Returns NULL on end of file. Returned line must be
+ * freed by the caller. */
+static char *getcmdline(const char *prompt) {
+  char *line = NULL;
+  size_t size = 0;
+
+  if (cmdstr) {
+    if (*cmdstr == '\0')
+      return NULL;
+    size = strcspn(cmdstr, "\n");
+    line = strndup(cmdstr, size);
+    cmdstr += size + (cmdstr[size] == '\n');
+    return line;
+  }
 
-  line[0] = '\0';
+  if (prompt)
+    if (write(STDOUT_FILENO, prompt, strlen(prompt))) {};
 
-  ssize_t nread = read(STDIN_FILENO, line, MAXLINE);
+  ssize_t nread = rio_getlineb(&input, &line, &size);
   if (nread < 0) {
     if (errno != EINTR)
       unix_error("Read error");
     msg("\n");
+    free(line);
+    return strdup("");
   } else if (nread == 0) {
+    free(line);
     return NULL; /* EOF */
-  } else {
-    if (line[nread - 1] == '\n')
-      line[nread - 1] = '\0';
   }
 
-  return strdup(line);
+  if (line[nread - 1] == '\n')
+    line[nread - 1] = '\0';
+
+  return line;
 }
-#endif
 
-int main(int argc, char *argv[]) {
-  /* `stdin` should be attached to terminal running in canonical mode */
-  if (!isatty(STDIN_FILENO))
-    app_error("ERROR: Shell can run only in interactive mode!");
+#ifdef READLINE
+static char *(*readline_p)(const char *prompt) = NULL;
+static void (*add_history_p)(const char *line) = NULL;
+
+/* GNU readline is loaded and initialized when the first prompt is displayed,
+ * so scripts and one-shot commands never pay for mapping and relocating it.
+ * If the library is missing, plain buffered input is used instead. */
+static bool load_readline(void) {
+  static bool loaded = false;
+
+  if (!loaded) {
+    loaded = true;
+    void *handle = dlopen("libreadline.so.8", RTLD_NOW);
+    if (handle == NULL)
+      handle = dlopen("libreadline.so", RTLD_NOW);
+    if (handle) {
+      readline_p = dlsym(handle, "readline");
+      add_history_p = dlsym(handle, "add_history");
+    }
+  }
+
+  return readline_p && add_history_p;
+}
+#endif
 
+/* Prompt is displayed only when the user types in commands. */
+static char *nextcmdline(const char *prompt) {
+  if (!interactive)
+    prompt = NULL;
 #ifdef READLINE
-  rl_initialize();
+  if (prompt && load_readline())
+    return readline_p(prompt);
 #endif
+  return getcmdline(prompt);
+}
+
+/* Lines read in after the command line, i.e. here-document bodies and
+ * continuation lines, are kept on this list until the command is run. */
+typedef struct {
+  char **buf;
+  int n;
+} lines_t;
+
+static void keepline(lines_t *lines, char *line) {
+  lines->buf = Realloc(lines->buf, sizeof(char *) * (lines->n + 1));
+  lines->buf[lines->n++] = line;
+}
+
+static void freelines(lines_t *lines) {
+  while (lines->n > 0)
+    free(lines->buf[--lines->n]);
+  free(lines->buf);
+  lines->buf = NULL;
+}
+
+/* Here-document body consists of lines that follow the command line up to
+ * a line equal to the delimiter. The body is put in place of the delimiter
+ * token and also recorded in `lines` to be freed after the command is run. */
+static void readheredocs(token_t *token, int ntokens, lines_t *lines) {
+  for (int i = 0; i < ntokens; i++) {
+    if (token[i] != T_HEREDOC || i + 1 == ntokens || !string_p(token[i + 1]))
+      continue;
+
+    const char *delim = token[++i];
+    char *body = NULL, *line;
+    size_t len = 0;
+
+    while ((line = nextcmdline("> ")) && strcmp(line, delim)) {
+      size_t n = strlen(line);
+      body = Realloc(body, len + n + 2);
+      memcpy(body + len, line, n);
+      body[len + n] = '\n';
+      len += n + 1;
+      free(line);
+    }
+
+    if (line == NULL)
+      msg("warning: here-document delimited by end of file\n");
+    free(line);
+
+    if (body == NULL)
+      body = Malloc(1);
+    body[len] = '\0';
+    token[i] = body;
+    keepline(lines, body);
+  }
+}
+
+/* Tokenize a command line and read its here-documents. As long as some
+ * compound command is left open, further lines are read and joined with
+ * the command line, as if they were separated with `;` where needed. */
+static token_t *lexcmd(char *line, int *ntokensp, lines_t *lines) {
+  int ntokens, depth = 0;
+  bool start = true;
+  token_t *token = tokenize(line, &ntokens);
+
+  readheredocs(token, ntokens, lines);
+  for (int i = 0; i < ntokens; i++)
+    depth += nesting(token[i], &start);
+
+  while (depth > 0 && (line = nextcmdline("> "))) {
+    int n;
+    token_t *more = tokenize(line, &n);
+
+    keepline(lines, line);
+    readheredocs(more, n, lines);
+
+    if (n > 0) {
+      token = Realloc(token, sizeof(token_t) * (ntokens + n + 2));
+      if (!start) {
+        token[ntokens++] = T_COLON;
+        start = true;
+      }
+      for (int i = 0; i < n; i++)
+        depth += nesting(token[ntokens++] = more[i], &start);
+      token[ntokens] = NULL;
+    }
+
+    free(more);
+  }
+
+  *ntokensp = ntokens;
+  return token;
+}
+
+/* In dry run (-n) each command is taken apart as it would be before it's
+ * started. Its redirections go through do_redir, and process substitutions
+ * are checked as command lines of their own, like a subshell would. */
+static int dryrun(token_t *token, int ntokens) {
+  token_t *argv = Malloc(sizeof(token_t) * (ntokens + 1));
+  int argc = 0, exitcode = 0;
+
+  for (int i = 0; i <= ntokens; i++) {
+    token_t t = i < ntokens ? token[i] : T_NULL;
+
+    if ((t == T_PSUBIN || t == T_PSUBOUT) && i + 1 < ntokens) {
+      char *rest = cmdstr;
+      char *cmd = strdup(token[++i]);
+      cmdstr = "";
+      if (eval(cmd))
+        exitcode = 2;
+      cmdstr = rest;
+      free(cmd);
+      argv[argc++] = "/dev/fd/0";
+    } else if (t == T_PIPESZ) {
+      i++;
+    } else if (!separator_p(t)) {
+      argv[argc++] = t;
+    } else if (argc > 0) {
+      argv[argc] = NULL;
+      if (do_redir(argv, argc) < 0 && !exitcode)
+        exitcode = 1;
+      argc = 0;
+    }
+  }
+
+  free(argv);
+  return exitcode;
+}
+
+/* Check tokenized command line and run it. */
+static int run(token_t *token, int ntokens) {
+  interrupted = 0;
+  if (!well_formed(token, ntokens))
+    return lastexitcode = 2;
+  return noexec ? dryrun(token, ntokens) : do_list(token, ntokens, true);
+}
+
+static int eval(char *cmdline) {
+  lines_t lines = {NULL, 0};
+  int ntokens;
+  int exitcode = 0;
+  token_t *token = lexcmd(cmdline, &ntokens, &lines);
+
+  if (ntokens > 0)
+    exitcode = run(token, ntokens);
+
+  freelines(&lines);
+  free(token);
+  return exitcode;
+}
+
+/* Compile whole script read from `input`, so it can be cached. */
+static script_t *compile(const char *path) {
+  script_t *sc = script_new(path);
+  char *line;
+
+  if (sc == NULL)
+    return NULL;
+
+  while ((line = nextcmdline(NULL))) {
+    lines_t lines = {NULL, 0};
+    int ntokens;
+    token_t *token = lexcmd(line, &ntokens, &lines);
+    if (ntokens > 0)
+      script_add(sc, token, ntokens);
+    freelines(&lines);
+    free(token);
+    free(line);
+  }
+
+  script_save(sc);
+  return sc;
+}
+
+/* Check command lines in `cmds` without running them, like `-n -c` does.
+ * It's the entry point of the fuzzing harness, see fuzz/fuzz.c. */
+int checkcmds(char *cmds) {
+  int exitcode = 0;
+  char *line;
+
+  noexec = true;
+  cmdstr = cmds;
+  while ((line = nextcmdline(NULL))) {
+    if (*line)
+      exitcode = eval(line);
+    free(line);
+  }
+  return exitcode;
+}
+
+#ifndef FUZZ
+int main(int argc, char *argv[]) {
+  script_t *script = NULL;
+  bool nocache = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:nN")) != -1) {
+    if (opt == 'c')
+      cmdstr = optarg;
+    else if (opt == 'n')
+      noexec = true;
+    else if (opt == 'N')
+      nocache = true;
+    else
+      app_error("usage: %s [-nN] [-c command | script]", argv[0]);
+  }
 
   sigemptyset(&sigchld_mask);
   sigaddset(&sigchld_mask, SIGCHLD);
+  sigaddset(&sigchld_mask, SIGADMIT);
+
+  /* Script name (or `-c` argument that follows the command string) is $0,
+   * the following arguments are $1, $2, ... */
+  if (optind < argc)
+    setparams(argv + optind, argc - optind - 1, NULL);
+  else
+    setparams(argv, 0, NULL);
+
+  /* Commands come from a `-c` string, a script file, a pipe or a terminal.
+   * Only in the last case the shell takes control of the terminal and does
+   * job control. Otherwise jobs stay in the shell's process group, the
+   * terminal is left alone and there is no prompt nor line editing.
+   *
+   * One-shot mode (-c) is used to run a single command line as cheaply as
+   * possible: the job table gets allocated only if some command other than
+   * the last one needs a subprocess, and the last one replaces the shell. */
+  if (cmdstr == NULL) {
+    int fd = STDIN_FILENO;
+    if (optind < argc)
+      fd = highfd(Open(argv[optind], O_RDONLY | O_CLOEXEC, 0), true);
+    interactive = fd == STDIN_FILENO && isatty(STDIN_FILENO);
+    /* Script that is read as it runs gets next lines read ahead meanwhile.
+     * One that is compiled is read as a whole at once, straight from page
+     * cache through a mapping. */
+    if (fd == STDIN_FILENO)
+      rio_readinitb(&input, fd);
+    else if (noexec || nocache)
+      rio_readinitb_ring(&input, fd, SCRIPT_READAHEAD);
+    else
+      rio_readinitb_map(&input, fd);
+
+    /* Scripts are lexed once and then run from compiled image, that is kept
+     * in a cache file (unless -N is given) and reused by later runs. */
+    if (fd != STDIN_FILENO && !noexec && !nocache)
+      if ((script = script_open(argv[optind])) == NULL)
+        script = compile(argv[optind]);
+  }
 
-  if (getsid(0) != getpgid(0))
-    Setpgid(0, 0);
+  if (!noexec) {
+    if (interactive && getsid(0) != getpgid(0))
+      Setpgid(0, 0);
 
-  initjobs();
+    initjobs(interactive);
+  }
 
-  struct sigaction act = {
-    .sa_handler = sigint_handler,
-    .sa_flags = 0, /* without SA_RESTART read() will return EINTR */
-  };
-  Sigaction(SIGINT, &act, NULL);
+  if (interactive) {
+    struct sigaction act = {
+      .sa_handler = sigint_handler,
+      .sa_flags = 0, /* without SA_RESTART read() will return EINTR */
+    };
+    Sigaction(SIGINT, &act, NULL);
 
-  Signal(SIGTSTP, SIG_IGN);
-  Signal(SIGTTIN, SIG_IGN);
-  Signal(SIGTTOU, SIG_IGN);
+    Signal(SIGTSTP, SIG_IGN);
+    Signal(SIGTTIN, SIG_IGN);
+    Signal(SIGTTOU, SIG_IGN);
+  }
 
-  while (true) {
-    char *line = readline("# ");
+  int exitcode = 0;
 
-    if (line == NULL)
-      break;
+  if (script) {
+    int ntokens;
+    token_t *token;
+
+    while ((token = script_next(script, &ntokens))) {
+      exitcode = run(token, ntokens);
+      free(token);
+      watchjobs(FINISHED);
+    }
+
+    script_close(script);
+  } else {
+    char *line;
 
-    if (strlen(line)) {
+    while ((line = nextcmdline("# "))) {
+      if (strlen(line)) {
 #ifdef READLINE
-      add_history(line);
+        if (interactive && add_history_p)
+          add_history_p(line);
 #endif
-      eval(line);
+        exitcode = eval(line);
+      }
+      free(line);
+      if (!noexec)
+        watchjobs(FINISHED);
     }
-    free(line);
-    watchjobs(FINISHED);
   }
 
-  msg("\n");
-  shutdownjobs();
+  if (interactive)
+    msg("\n");
+  if (!noexec)
+    shutdownjobs();
 
-  return 0;
+  return exitcode;
 }
+#endif /* !FUZZ */
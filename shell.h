@@ -5,6 +5,9 @@
 
 #define msg(...) dprintf(STDERR_FILENO, __VA_ARGS__)
 
+void bmsg(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void bflush(void);
+
 #if DEBUG > 0
 #define debug(...) dprintf(STDERR_FILENO, __VA_ARGS__)
 #else
@@ -12,6 +15,7 @@
 #endif
 
 typedef char *token_t;
+typedef struct pipestat pipestat_t;
 
 #define T_NULL ((token_t)0)
 #define T_AND ((token_t)1)
@@ -23,12 +27,34 @@ typedef char *token_t;
 #define T_INPUT ((token_t)7)
 #define T_APPEND ((token_t)8)
 #define T_BANG ((token_t)9)
+#define T_HEREDOC ((token_t)10)
+#define T_HERESTR ((token_t)11)
+#define T_PIPESZ ((token_t)12) /* follows T_PIPE, next token is pipe size */
+#define T_PSUBIN ((token_t)13)  /* <(cmd), next token is the command */
+#define T_PSUBOUT ((token_t)14) /* >(cmd), next token is the command */
+#define T_FD ((token_t)15)      /* next token is the descriptor, e.g. 2 in 2> */
+#define T_DUPOUT ((token_t)16)  /* >&, next token is descriptor or - */
+#define T_DUPIN ((token_t)17)   /* <&, next token is descriptor or - */
+#define T_RDWR ((token_t)18)    /* <> */
+#define T_OUTERR ((token_t)19)  /* &> */
 #define separator_p(t) ((t) <= T_COLON)
-#define string_p(t) ((t) > T_BANG)
+#define redir_p(t)                                                             \
+  (((t) >= T_OUTPUT && (t) <= T_APPEND) ||                                     \
+   ((t) >= T_HEREDOC && (t) <= T_OUTERR))
+#define string_p(t) ((t) > T_OUTERR)
+
+/* Descriptors 0..9 belong to the user, they can be redirected and kept open
+ * with `exec`. Descriptors the shell keeps for itself are placed above. */
+#define NREDIRFD 10
 
 void strapp(char **dstp, const char *src);
 token_t *tokenize(char *s, int *tokc_p);
 
+extern int lastexitcode;
+char **setparams(char **argv, int argc, int *oldargcp);
+bool assignment_p(const char *word);
+char *expand(const char *word);
+
 /* Do not change those values or code will break! */
 enum {
   FG = 0, /* foreground job */
@@ -43,21 +69,64 @@ enum {
   STOPPED = 2,  /* jobs that have been suspended by SIGTSTP / SIGSTOP */
 };
 
-void initjobs(void);
+void initjobs(bool interactive);
 void shutdownjobs(void);
+void subshelljobs(void);
 
 int addjob(pid_t pgid, int bg);
 void addproc(int job, pid_t pid, char **argv);
+void setjobstat(int job, pipestat_t *ps);
+void setjobpipefail(int job);
+void statjobs(void);
 bool killjob(int job);
+int jobstate(int job, int *statusp);
 void watchjobs(int state);
 char *jobcmd(int job);
 bool resumejob(int job, int bg, sigset_t *mask);
 int monitorjob(sigset_t *mask);
+void queuejob(int job);
+bool queuedjobs(void);
+bool releasejob(void);
 
 void setfgpgrp(pid_t pgid);
+pid_t jobpgrp(pid_t pid);
+
+long pipesize(const char *s);
+void setpipesize(int fd, long size);
+void watchpipe(pid_t reader, int fd);
+void growpipes(bool start);
+
+/* Signal sent by admission timer, it's blocked along with SIGCHLD. */
+#define SIGADMIT SIGRTMIN
+
+bool admitjob(void);
+bool pressure_ok(void);
+void admittimer(bool on);
+
+pipestat_t *pipestat_new(int nstages);
+void pipestat_free(pipestat_t *ps);
+void pipestat_setcmd(pipestat_t *ps, int stage, char **argv);
+noreturn void pipestat_relay(pipestat_t *ps, int edge, int in, int out);
+void pipestat_print(int j, pipestat_t *ps);
+
+typedef struct script script_t;
+
+script_t *script_open(const char *path);
+script_t *script_new(const char *path);
+void script_add(script_t *sc, token_t *token, int ntokens);
+void script_save(script_t *sc);
+token_t *script_next(script_t *sc, int *ntokensp);
+void script_close(script_t *sc);
 
 int builtin_command(char **argv);
+bool builtin_p(const char *name);
 noreturn void external_command(char **argv);
+noreturn void subshell(char *cmdline, token_t *argv);
+int checkcmds(char *cmds);
+pid_t spawn(void);
+
+/* Set when SIGINT arrives, loops run by the shell check it to stop early. */
+extern volatile sig_atomic_t interrupted;
 
 /* Used by Sigprocmask to enter critical section protecting against SIGCHLD. */
 extern sigset_t sigchld_mask;
@@ -0,0 +1,88 @@
+#!/bin/sh
+# Commands started by the shell must see only descriptors they inherit from
+# the shell's parent and the ones they get redirected, never the ones the
+# shell opens for itself. Each case lists /proc/self/fd of some command and
+# compares it with what the test itself has, plus or minus expected changes.
+
+SH=${SH:-./shell}
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+failed=0
+
+export LC_ALL=C
+
+# Descriptor numbers listed by `ls -l /proc/self/fd` in file $1, one per line,
+# without the directory ls opens to read the list.
+fds() {
+  awk '$9 ~ /^[0-9]+$/ && $NF !~ /^\/proc\/[0-9]+\/fd$/ { print $9 }' "$1" |
+    sort -n | tr '\n' ' '
+}
+
+ls -l /proc/self/fd > "$T/base"
+base=$(fds "$T/base")
+
+# check NAME CHANGES LINE... - run LINEs as a script, then compare listing
+# written to $T/out (or to stdout) with the base one, with CHANGES made, e.g.
+# "5" for a descriptor that must be there too, "-0" for one that must not.
+check() {
+  name=$1 changes=$2
+  shift 2
+  printf '%s\n' "$@" > "$T/script"
+  rm -f "$T/out"
+  $SH -N "$T/script" > "$T/stdout" 2> "$T/stderr" < /dev/null
+  [ -s "$T/out" ] || cp "$T/stdout" "$T/out"
+
+  want=$(for fd in $base $changes; do echo "$fd"; done |
+    awk '/^-/ { drop[substr($0, 2)] = 1; next } { keep[$0] = 1 }
+         END { for (fd in keep) if (!(fd in drop)) print fd }' |
+    sort -n | tr '\n' ' ')
+  got=$(fds "$T/out")
+
+  if [ "$got" = "$want" ]; then
+    echo "ok: $name"
+  else
+    echo "FAIL: $name: expected '$want', got '$got'"
+    sed 's/^/  stderr: /' "$T/stderr"
+    failed=1
+  fi
+}
+
+# finishes NAME LINE... - run LINEs as a script, which must not hang because
+# some process holds a pipe end it shouldn't.
+finishes() {
+  name=$1
+  shift
+  printf '%s\n' "$@" > "$T/script"
+  if timeout 10 $SH -N "$T/script" > /dev/null 2> "$T/stderr" < /dev/null; then
+    echo "ok: $name"
+  else
+    echo "FAIL: $name: exit status $?"
+    sed 's/^/  stderr: /' "$T/stderr"
+    failed=1
+  fi
+}
+
+LS="ls -l /proc/self/fd"
+
+check "plain command" "" "$LS"
+check "output redirection" "" "$LS > $T/out"
+check "input redirection" "" "$LS < /dev/null > $T/out"
+check "numbered redirection" "5" "$LS 5> $T/five > $T/out"
+check "duplicated descriptor" "" "$LS 2>&1 > $T/out"
+check "closed descriptor" "-0" "$LS 0>&- > $T/out"
+check "here-document" "" "$LS > $T/out << END" "text" "END"
+check "first pipeline stage" "" "$LS | cat > $T/out"
+check "middle pipeline stage" "" "echo | $LS | cat > $T/out"
+check "kept with exec" "3" "exec 3> $T/three" "$LS > $T/out"
+check "closed with exec" "" "exec 3> $T/three" "exec 3>&-" "$LS > $T/out"
+check "background job" "" "$LS > $T/out &" "sleep 0.3"
+check "function" "" "f() { $LS > $T/out ; }" "f"
+check "process substitution" "" "cat <($LS) > $T/out"
+check "parallel" "" "echo /proc/self/fd | parallel ls -l {} > $T/out"
+check "coprocess" "" "coproc cat" "$LS > $T/out"
+check "coprocess by redirection" "3" "coproc cat" "$LS 3>&\$COPROC_FD > $T/out"
+finishes "builtin in pipeline" "cat /dev/zero | head -c 10"
+finishes "builtin in middle stage" "cat /dev/zero | cat | head -c 10"
+finishes "redirection to substitution" "echo hi > >(cat)"
+
+exit $failed